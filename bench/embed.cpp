@@ -0,0 +1,58 @@
+// Measures the per-invocation overhead of running a small script from C++:
+// recompiling every call, a fresh VM per call, and one reused VM reset between calls.
+#include "vm.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+using namespace Lox;
+
+namespace {
+  constexpr auto source = "var y = x * 2 + 1; var label = \"result: \" + y;";
+
+  template<typename F>
+  void measure(const char* name, unsigned iterations, F&& invoke) {
+    const auto start = std::chrono::steady_clock::now();
+    for (auto i = 0u; i < iterations; ++i) invoke(i);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    printf("%-24s %10.1f ns/call\n", name, static_cast<double>(nanoseconds) / iterations);
+  }
+}
+
+int main(int argc, char** argv) {
+  const auto iterations = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 100000u;
+
+  std::ostringstream sink {};
+  VMOptions options {};
+  options.stackCapacity = 64;
+
+  measure("interpret (recompile)", iterations, [&](unsigned i) {
+    VM vm { options, sink };
+    vm.setGlobal("x", static_cast<double>(i));
+    vm.interpret(source, 1);
+  });
+
+  VM compiler { options, sink };
+  const auto chunk = compiler.compile(source, 1);
+
+  measure("run (fresh VM)", iterations, [&](unsigned i) {
+    VM vm { options, sink };
+    vm.setGlobal("x", static_cast<double>(i));
+    vm.run(chunk);
+  });
+
+  VM vm { options, sink };
+  auto checksum = 0.0;
+  measure("run (reused VM)", iterations, [&](unsigned i) {
+    vm.reset();
+    vm.setGlobal("x", static_cast<double>(i));
+    vm.run(chunk);
+    checksum += std::get<double>(*vm.getGlobal("y"));
+  });
+
+  printf("checksum: %g\n", checksum);
+}
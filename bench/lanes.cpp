@@ -0,0 +1,57 @@
+// Compares running one script per record on a reused VM with running it over the same records in lane groups,
+// for straight-line arithmetic and for a loop whose trip count differs from record to record.
+#include "lane-group.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace Lox;
+
+namespace {
+  constexpr auto arithmetic = "var y = x * 2 + 1; var isLarge = y > 1000;";
+  constexpr auto loop = "var y = 0; { for (var i = 0; i < x; i = i + 1) y = y + i * 0.5; }";
+
+  double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double> { std::chrono::steady_clock::now() - start }.count();
+  }
+
+  void measure(const char* name, const char* source, unsigned recordCount, double modulus) {
+    std::ostringstream sink {};
+    VM vm { {}, sink };
+    const auto chunk = vm.compile(source, 1);
+
+    std::vector<double> inputs {};
+    for (auto i = 0u; i < recordCount; ++i) inputs.push_back(static_cast<double>(i % static_cast<unsigned>(modulus)));
+
+    auto start = std::chrono::steady_clock::now();
+    auto scalarChecksum = 0.0;
+    for (const auto input : inputs) {
+      vm.reset();
+      vm.setGlobal("x", input);
+      vm.run(chunk);
+      scalarChecksum += std::get<double>(*vm.getGlobal("y"));
+    }
+    const auto scalarTime = secondsSince(start);
+
+    LaneGroup lanes { vm, chunk, { "x" }, { "y" } };
+    start = std::chrono::steady_clock::now();
+    auto laneChecksum = 0.0;
+    for (const auto& output : lanes.run(inputs, recordCount).outputs) laneChecksum += std::get<double>(output);
+    const auto laneTime = secondsSince(start);
+
+    printf(
+      "%-12s scalar %8.1f ns/record, lanes %8.1f ns/record (%.2fx), %zu scalar lanes, checksums %s\n",
+      name, scalarTime * 1e9 / recordCount, laneTime * 1e9 / recordCount, scalarTime / laneTime,
+      lanes.scalarLaneCount(), scalarChecksum == laneChecksum ? "match" : "DIFFER");
+  }
+}
+
+int main(int argc, char** argv) {
+  const auto recordCount = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 1000000u;
+
+  measure("arithmetic", arithmetic, recordCount, 2000);
+  measure("loop", loop, recordCount / 10, 50);
+}
@@ -0,0 +1,50 @@
+// Measures number-to-string conversion in a script: printing numbers and concatenating them onto strings.
+#include "vm.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+using namespace Lox;
+
+namespace {
+  constexpr auto printSource =
+    "for (var i = 0; i < 1000; i = i + 1) { print i / 7; print i * 1000003; }";
+  constexpr auto concatenateSource =
+    "var s = \"\"; for (var i = 0; i < 1000; i = i + 1) { s = \"x\" + i / 3 + \",\" + i; }";
+
+  template<typename F>
+  void measure(const char* name, unsigned iterations, F&& invoke) {
+    const auto start = std::chrono::steady_clock::now();
+    for (auto i = 0u; i < iterations; ++i) invoke();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    printf("%-24s %10.1f us/run\n", name, static_cast<double>(nanoseconds) / iterations / 1000);
+  }
+}
+
+int main(int argc, char** argv) {
+  const auto iterations = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 200u;
+
+  std::ostringstream sink {};
+  for (const auto isExact : { false, true }) {
+    VMOptions options {};
+    options.isExactNumberOutput = isExact;
+    VM vm { options, sink };
+
+    const auto print = vm.compile(printSource, 1);
+    const auto concatenate = vm.compile(concatenateSource, 1);
+
+    measure(isExact ? "print (exact)" : "print", iterations, [&] {
+      sink.str({});
+      vm.run(print);
+    });
+
+    measure(isExact ? "concatenate (exact)" : "concatenate", iterations, [&] {
+      vm.reset();
+      vm.run(concatenate);
+    });
+  }
+}
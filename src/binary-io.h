@@ -0,0 +1,37 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+namespace Lox {
+  // Raw values in native byte order, for files only read back on the same machine.
+  template<typename T>
+  void writeRaw(std::ostream& output, T value) {
+    output.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<typename T>
+  bool readRaw(std::istream& input, T& value) {
+    return static_cast<bool>(input.read(reinterpret_cast<char*>(&value), sizeof(T)));
+  }
+
+  // Reads length bytes into a string or byte vector, growing it only as the data arrives, so a corrupt length
+  // cannot make it allocate much more than the input actually holds.
+  template<typename Container>
+  bool readBytes(std::istream& input, Container& bytes, std::uint32_t length) {
+    constexpr size_t blockSize = 64 * 1024;
+
+    bytes.clear();
+    while (bytes.size() < length) {
+      const auto offset = bytes.size();
+      const auto count = std::min<size_t>(blockSize, length - offset);
+      bytes.resize(offset + count);
+      if (!input.read(reinterpret_cast<char*>(bytes.data() + offset), static_cast<std::streamsize>(count))) return false;
+    }
+
+    return true;
+  }
+}
@@ -0,0 +1,413 @@
+#include "c-emitter.h"
+
+#include "chunk.h"
+#include <array>
+#include <charconv>
+#include <cstdio>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+  using Lox::OpCode;
+
+  // Mirrors the VM's semantics and messages; `isExactNumberOutput` is emitted just before it.
+  constexpr auto runtime = R"(
+  struct Native;
+  using String = std::shared_ptr<const std::string>;
+  using Value = std::variant<std::monostate, bool, double, String, const Native*>;
+
+  struct Native {
+    std::string name;
+    size_t arity;
+    Value (*function)(const Value* arguments);
+  };
+
+  struct RuntimeError {
+    std::string message;
+    unsigned line;
+    unsigned column;
+  };
+
+  std::unordered_map<std::string, Value> globals {};
+
+  // The VM's standard natives; natives a host program registers on its VM cannot be translated.
+  const std::unordered_map<std::string, Native> natives {
+    { "clock", { "clock", 0, [](const Value*) -> Value {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    } } }
+  };
+
+  Value str(const char* chars, size_t size) { return std::make_shared<const std::string>(chars, size); }
+
+  [[noreturn]] void fail(std::string message, unsigned line, unsigned column) {
+    throw RuntimeError { std::move(message), line, column };
+  }
+
+  bool truthy(const Value& value) {
+    return std::holds_alternative<bool>(value) ? std::get<bool>(value) : !std::holds_alternative<std::monostate>(value);
+  }
+
+  bool equal(const Value& left, const Value& right) {
+    const auto leftString = std::get_if<String>(&left);
+    const auto rightString = std::get_if<String>(&right);
+    if (leftString && rightString) return **leftString == **rightString;
+
+    return left == right;
+  }
+
+  std::string stringify(const Value& value) {
+    if (const auto string = std::get_if<String>(&value)) return **string;
+
+    if (const auto number = std::get_if<double>(&value)) {
+      std::array<char, 32> buffer;
+      const auto end = buffer.data() + buffer.size();
+      const auto result = isExactNumberOutput
+        ? std::to_chars(buffer.data(), end, *number)
+        : std::to_chars(buffer.data(), end, *number, std::chars_format::general, 6);
+      return { buffer.data(), static_cast<size_t>(result.ptr - buffer.data()) };
+    }
+
+    if (const auto boolean = std::get_if<bool>(&value)) return *boolean ? "true" : "false";
+    if (std::holds_alternative<const Native*>(value)) return "<native fn>";
+
+    return "nil";
+  }
+
+  const std::string& nameOf(const Value& name) { return *std::get<String>(name); }
+
+  void defineGlobal(const Value& name, const Value& value, unsigned line, unsigned column) {
+    if (!globals.emplace(nameOf(name), value).second) {
+      fail("Identifier '" + nameOf(name) + "' is already defined.", line, column);
+    }
+  }
+
+  Value setGlobal(const Value& name, const Value& value, unsigned line, unsigned column) {
+    const auto global = globals.find(nameOf(name));
+    if (global == globals.end()) fail("Identifier '" + nameOf(name) + "' is undefined.", line, column);
+
+    return global->second = value;
+  }
+
+  Value getGlobal(const Value& name, unsigned line, unsigned column) {
+    const auto global = globals.find(nameOf(name));
+    if (global != globals.end()) return global->second;
+
+    const auto native = natives.find(nameOf(name));
+    if (native == natives.end()) fail("Identifier '" + nameOf(name) + "' is undefined.", line, column);
+
+    return &native->second;
+  }
+
+  Value call(const Value& callee, std::initializer_list<Value> arguments, unsigned line, unsigned column) {
+    const auto native = std::get_if<const Native*>(&callee);
+    if (!native) fail("Only functions can be called.", line, column);
+
+    const auto arity = (*native)->arity;
+    if (arity != arguments.size()) {
+      fail(
+        "'" + (*native)->name + "' expects " + std::to_string(arity) + " argument" + (arity == 1 ? "" : "s") +
+        " but got " + std::to_string(arguments.size()) + ".",
+        line, column
+      );
+    }
+
+    return (*native)->function(arguments.begin());
+  }
+
+  template<typename Operation>
+  Value calculate(const Value& left, const Value& right, Operation operation, unsigned line, unsigned column) {
+    if (!std::holds_alternative<double>(left) || !std::holds_alternative<double>(right)) {
+      fail("Operand must be a number.", line, column);
+    }
+
+    return operation(std::get<double>(left), std::get<double>(right));
+  }
+
+  Value add(const Value& left, const Value& right, unsigned line, unsigned column) {
+    if (std::holds_alternative<String>(left) || std::holds_alternative<String>(right)) {
+      return std::make_shared<const std::string>(stringify(left) + stringify(right));
+    }
+
+    return calculate(left, right, std::plus<> {}, line, column);
+  }
+
+  Value divide(const Value& left, const Value& right, unsigned line, unsigned column) {
+    if (std::holds_alternative<double>(right) && std::get<double>(right) == 0) fail("Cannot divide by zero.", line, column);
+
+    return calculate(left, right, std::divides<> {}, line, column);
+  }
+
+  template<typename Comparison>
+  Value compare(const Value& left, const Value& right, Comparison comparison, unsigned line, unsigned column) {
+    if (std::holds_alternative<double>(left)) {
+      if (!std::holds_alternative<double>(right)) fail("Operand must be a number.", line, column);
+
+      return comparison(std::get<double>(left), std::get<double>(right));
+    }
+
+    if (!std::holds_alternative<String>(left) || !std::holds_alternative<String>(right)) {
+      fail("Operand must be a string.", line, column);
+    }
+
+    return comparison(std::get<String>(left)->compare(*std::get<String>(right)), 0);
+  }
+
+  Value negate(const Value& value, unsigned line, unsigned column) {
+    if (!std::holds_alternative<double>(value)) fail("Operand must be a number.", line, column);
+
+    return -std::get<double>(value);
+  }
+
+  void print(const Value& value) { std::cout << stringify(value) << '\n'; }
+}
+
+int run();
+
+int main() {
+  try {
+    return run();
+  } catch (const lox::RuntimeError& error) {
+    std::cerr
+      << "\033[31m runtime error  \033[0m" << error.message
+      << "\033[90m (" << error.line << ':' << error.column << ")\n\033[0m";
+    return 70;
+  }
+}
+)";
+
+  std::string numberLiteral(double number) {
+    if (number != number) return "std::numeric_limits<double>::quiet_NaN()";
+    if (number == std::numeric_limits<double>::infinity()) return "std::numeric_limits<double>::infinity()";
+    if (number == -std::numeric_limits<double>::infinity()) return "-std::numeric_limits<double>::infinity()";
+
+    std::array<char, 32> buffer;
+    const auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), number);
+    std::string literal { buffer.data(), static_cast<size_t>(result.ptr - buffer.data()) };
+    return literal.find_first_of(".e") == std::string::npos ? literal + ".0" : literal;
+  }
+
+  // Octal escapes have at most three digits, so unlike hex escapes they cannot swallow the character after them.
+  std::string stringLiteral(const std::string& chars) {
+    std::string literal { "\"" };
+    for (const auto c : chars) {
+      if (c >= ' ' && c <= '~' && c != '"' && c != '\\') {
+        literal += c;
+      } else {
+        std::array<char, 5> escape;
+        std::snprintf(escape.data(), escape.size(), "\\%03o", static_cast<unsigned char>(c));
+        literal += escape.data();
+      }
+    }
+
+    return literal + '"';
+  }
+
+  std::string constantLiteral(const Lox::Value& value) {
+    if (const auto string = std::get_if<Lox::ObjString*>(&value)) {
+      const auto& chars = (*string)->chars;
+      return "str(" + stringLiteral(chars) + ", " + std::to_string(chars.size()) + ")";
+    }
+
+    if (const auto number = std::get_if<double>(&value)) return numberLiteral(*number);
+    if (const auto boolean = std::get_if<bool>(&value)) return *boolean ? "true" : "false";
+
+    return "Value {}";
+  }
+}
+
+namespace Lox {
+  void emitC(const Chunk& chunk, std::ostream& output, bool isExactNumberOutput) {
+    if (!chunk.isVerified()) throw std::invalid_argument { "Only verified chunks can be translated to C." };
+    for (size_t i = 0; i < chunk.constantCount(); ++i) {
+      if (std::holds_alternative<ObjFunction*>(chunk.getConstant(i))) {
+        throw std::invalid_argument { "Functions cannot be translated to C." };
+      }
+    }
+
+    std::vector<std::optional<size_t>> depths(chunk.size());
+    std::vector<bool> isTarget(chunk.size(), false);
+    std::vector<std::pair<size_t, size_t>> worklist { { 0, 0 } };
+    while (!worklist.empty()) {
+      auto [offset, depth] = worklist.back();
+      worklist.pop_back();
+
+      while (!depths[offset]) {
+        depths[offset] = depth;
+
+        const auto opCode = static_cast<OpCode>(chunk.read(offset));
+        const auto effect = stackEffect(opCode, hasOperand(opCode) ? static_cast<size_t>(chunk.read(offset + 1)) : 0);
+        depth = depth - effect.pops + effect.pushes;
+        if (isReturn(opCode)) break;
+
+        const auto next = offset + (hasOperand(opCode) ? 2 : 1);
+        if (isBranch(opCode)) {
+          const auto target = branchTarget(opCode, next, static_cast<size_t>(chunk.read(offset + 1)));
+          isTarget[target] = true;
+          if (isUnconditionalBranch(opCode)) {
+            offset = target;
+            continue;
+          }
+
+          worklist.emplace_back(target, depth);
+        }
+
+        offset = next;
+      }
+    }
+
+    output
+      << "// Generated by cclox --emit-c; build with a C++17 compiler.\n"
+      << "#include <array>\n#include <charconv>\n#include <chrono>\n#include <functional>\n#include <initializer_list>\n"
+      << "#include <iostream>\n#include <limits>\n"
+      << "#include <memory>\n#include <string>\n#include <unordered_map>\n#include <variant>\n\n"
+      << "namespace lox {\n"
+      << "  constexpr bool isExactNumberOutput = " << (isExactNumberOutput ? "true" : "false") << ";\n"
+      << runtime << '\n'
+      << "int run() {\n"
+      << "  using namespace lox;\n";
+
+    for (size_t i = 0; i < chunk.constantCount(); ++i) {
+      output << "  static const Value k" << i << " = " << constantLiteral(chunk.getConstant(i)) << ";\n";
+    }
+    for (size_t i = 0; i < chunk.maxStackDepth(); ++i) output << "  Value s" << i << " {};\n";
+    output << '\n';
+
+    for (size_t offset = 0; offset < chunk.size(); offset += hasOperand(static_cast<OpCode>(chunk.read(offset))) ? 2 : 1) {
+      if (!depths[offset]) continue;
+
+      const auto opCode = static_cast<OpCode>(chunk.read(offset));
+      const auto operand = hasOperand(opCode) ? static_cast<size_t>(chunk.read(offset + 1)) : 0;
+      const auto depth = *depths[offset];
+      const auto [line, column] = chunk.getPosition(offset);
+      const auto slot = [](size_t index) { return "s" + std::to_string(index); };
+      const auto top = depth > 0 ? slot(depth - 1) : std::string {};
+      const auto second = depth > 1 ? slot(depth - 2) : std::string {};
+      const auto position = ", " + std::to_string(line) + ", " + std::to_string(column) + ");\n";
+      const auto binary = [&](const std::string& function) { output << "  " << second << " = " << function << '(' << second << ", " << top; };
+      const auto next = offset + (hasOperand(opCode) ? 2 : 1);
+      const auto target = branchTarget(opCode, next, operand);
+
+      if (isTarget[offset]) output << "L" << offset << ":\n";
+      switch (opCode) {
+        case OpCode::Constant:
+          output << "  " << slot(depth) << " = k" << operand << ";\n";
+          break;
+        case OpCode::Nil:
+          output << "  " << slot(depth) << " = Value {};\n";
+          break;
+        case OpCode::True:
+          output << "  " << slot(depth) << " = true;\n";
+          break;
+        case OpCode::False:
+          output << "  " << slot(depth) << " = false;\n";
+          break;
+        case OpCode::Pop:
+          output << "  " << top << " = Value {};\n";
+          break;
+        case OpCode::DefineGlobal:
+          output << "  defineGlobal(" << second << ", " << top << position;
+          break;
+        case OpCode::SetGlobal:
+          binary("setGlobal");
+          output << position;
+          break;
+        case OpCode::GetGlobal:
+          output << "  " << top << " = getGlobal(" << top << position;
+          break;
+        case OpCode::SetLocal:
+          output << "  " << slot(operand) << " = " << top << ";\n";
+          break;
+        case OpCode::GetLocal:
+          output << "  " << slot(depth) << " = " << slot(operand) << ";\n";
+          break;
+        case OpCode::Equal:
+          binary("equal");
+          output << ");\n";
+          break;
+        case OpCode::NotEqual:
+          output << "  " << second << " = !equal(" << second << ", " << top << ");\n";
+          break;
+        case OpCode::Greater:
+          binary("compare");
+          output << ", std::greater<> {}" << position;
+          break;
+        case OpCode::GreaterEqual:
+          binary("compare");
+          output << ", std::greater_equal<> {}" << position;
+          break;
+        case OpCode::Less:
+          binary("compare");
+          output << ", std::less<> {}" << position;
+          break;
+        case OpCode::LessEqual:
+          binary("compare");
+          output << ", std::less_equal<> {}" << position;
+          break;
+        case OpCode::Add:
+          binary("add");
+          output << position;
+          break;
+        case OpCode::Subtract:
+          binary("calculate");
+          output << ", std::minus<> {}" << position;
+          break;
+        case OpCode::Multiply:
+          binary("calculate");
+          output << ", std::multiplies<> {}" << position;
+          break;
+        case OpCode::Divide:
+          binary("divide");
+          output << position;
+          break;
+        case OpCode::Negative:
+          output << "  " << top << " = negate(" << top << position;
+          break;
+        case OpCode::Not:
+          output << "  " << top << " = !truthy(" << top << ");\n";
+          break;
+        case OpCode::AddNumber:
+          output << "  " << second << " = std::get<double>(" << second << ") + std::get<double>(" << top << ");\n";
+          break;
+        case OpCode::LessNumber:
+          output << "  " << second << " = std::get<double>(" << second << ") < std::get<double>(" << top << ");\n";
+          break;
+        case OpCode::NegateNumber:
+          output << "  " << top << " = -std::get<double>(" << top << ");\n";
+          break;
+        case OpCode::Print:
+          output << "  print(" << top << ");\n";
+          break;
+        case OpCode::Jump:
+        case OpCode::Loop:
+          output << "  goto L" << target << ";\n";
+          break;
+        case OpCode::JumpIfTrue:
+        case OpCode::PopJumpIfTrue:
+        case OpCode::PopLoopIfTrue:
+          output << "  if (truthy(" << top << ")) goto L" << target << ";\n";
+          break;
+        case OpCode::JumpIfFalse:
+        case OpCode::PopJumpIfFalse:
+          output << "  if (!truthy(" << top << ")) goto L" << target << ";\n";
+          break;
+        case OpCode::Call: {
+          const auto callee = depth - operand - 1;
+          output << "  " << slot(callee) << " = call(" << slot(callee) << ", {";
+          for (auto i = callee + 1; i < depth; ++i) output << (i > callee + 1 ? ", " : " ") << slot(i);
+          output << (operand > 0 ? " }" : "}") << position;
+        } break;
+        case OpCode::ReturnValue:
+        case OpCode::Return:
+          output << "  return 0;\n";
+          break;
+      }
+    }
+
+    output << "}\n";
+  }
+}
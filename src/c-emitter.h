@@ -0,0 +1,13 @@
+#pragma once
+
+#include <iosfwd>
+
+namespace Lox {
+  class Chunk;
+
+  // Translates a verified chunk into a standalone C++17 program with the same output, errors and exit codes.
+  // Every stack slot, locals included, becomes a variable of the program, jumps become gotos,
+  // and number-only opcodes become plain arithmetic on doubles. Chunks that declare functions are not supported yet
+  // and are rejected with std::invalid_argument.
+  void emitC(const Chunk& chunk, std::ostream& output, bool isExactNumberOutput);
+}
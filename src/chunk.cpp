@@ -1,15 +1,280 @@
 #include "chunk.h"
 
+#include "binary-io.h"
 #include "token.h"
+#include "verifier.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace {
+  constexpr char magic[] = { 'L', 'O', 'X', 'C' };
+  constexpr std::uint8_t formatVersion = 6;
+  constexpr size_t maxConstants = static_cast<size_t>(std::numeric_limits<unsigned char>::max()) + 1;
+  // Bounds the recursion through function constants; the compiler never nests functions anywhere near this deep.
+  constexpr size_t maxFunctionDepth = 128;
+
+  enum class ConstantTag : std::uint8_t {
+    Nil,
+    Boolean,
+    Number,
+    String,
+    Function
+  };
+}
 
 namespace Lox {
   void Chunk::write(OpCode opCode, const Token& token) {
+    write(opCode, std::make_pair(token.line, token.column));
+  }
+
+  void Chunk::write(OpCode opCode, std::pair<unsigned, unsigned> position) {
     write(static_cast<std::byte>(opCode));
-    positions_.emplace(size() - 1, std::make_pair(token.line, token.column));
+    positions_.emplace(size() - 1, position);
+  }
+
+  void Chunk::truncate(size_t size) {
+    for (auto offset = size; offset < bytecode_.size(); ++offset) positions_.erase(offset);
+
+    bytecode_.resize(size);
   }
 
+  void Chunk::clear() {
+    bytecode_.clear();
+    constants_.clear();
+    strings_.clear();
+    functions_.clear();
+    positions_.clear();
+    stringIndices_.clear();
+    numberIndices_.clear();
+    arity_ = 0;
+    maxStackDepth_ = 0;
+    isVerified_ = false;
+  }
+
+  // Numbers are keyed by bit pattern, so 0 and -0 stay distinct and a NaN matches only an identical NaN.
   size_t Chunk::addConstant(Value&& value) {
+    if (const auto number = std::get_if<double>(&value)) {
+      std::uint64_t bits = 0;
+      std::memcpy(&bits, number, sizeof(bits));
+
+      const auto [existing, isNew] = numberIndices_.emplace(bits, constants_.size());
+      if (!isNew) return existing->second;
+    }
+
     constants_.push_back(std::move(value));
     return constants_.size() - 1;
   }
+
+  // Each distinct string gets one constant slot, keyed by a view of the chunk's own copy,
+  // so a repeated identifier or literal is looked up without allocating.
+  size_t Chunk::addString(std::string_view string) {
+    const auto existing = stringIndices_.find(string);
+    if (existing != stringIndices_.cend()) return existing->second;
+
+    auto& object = strings_.emplace_back(std::string { string }, true);
+    const auto index = addConstant(&object);
+    stringIndices_.emplace(object.chars, index);
+    return index;
+  }
+
+  size_t Chunk::addFunction(std::shared_ptr<ObjFunction> function) {
+    const auto index = addConstant(function.get());
+    functions_.push_back(std::move(function));
+    return index;
+  }
+
+  size_t Chunk::copyConstant(const Value& constant) {
+    if (const auto string = std::get_if<ObjString*>(&constant)) return addString((*string)->chars);
+    if (const auto function = std::get_if<ObjFunction*>(&constant)) return addFunction((*function)->shared_from_this());
+
+    return addConstant(Value { constant });
+  }
+
+  // Strings and functions are stored in the order their constants were added, so the dropped ones are at the back.
+  void Chunk::truncateConstants(size_t count) {
+    while (constants_.size() > count) {
+      const auto& constant = constants_.back();
+      if (std::holds_alternative<ObjString*>(constant)) {
+        stringIndices_.erase(strings_.back().chars);
+        strings_.pop_back();
+      } else if (const auto number = std::get_if<double>(&constant)) {
+        std::uint64_t bits = 0;
+        std::memcpy(&bits, number, sizeof(bits));
+        numberIndices_.erase(bits);
+      } else if (std::holds_alternative<ObjFunction*>(constant)) {
+        functions_.pop_back();
+      }
+
+      constants_.pop_back();
+    }
+  }
+
+  void Chunk::trackStackDepth(size_t entry) {
+    std::vector<bool> isVisited(bytecode_.size(), false);
+    std::vector<std::pair<size_t, size_t>> worklist { { entry, arity_ } };
+    maxStackDepth_ = std::max(maxStackDepth_, arity_);
+    while (!worklist.empty()) {
+      auto [offset, depth] = worklist.back();
+      worklist.pop_back();
+
+      while (offset < bytecode_.size() && !isVisited[offset]) {
+        isVisited[offset] = true;
+
+        const auto opCode = static_cast<OpCode>(bytecode_[offset]);
+        const auto operand = hasOperand(opCode) ? static_cast<size_t>(bytecode_[offset + 1]) : 0;
+        const auto effect = stackEffect(opCode, operand);
+        depth = depth - std::min(depth, effect.pops) + effect.pushes;
+        maxStackDepth_ = std::max(maxStackDepth_, depth);
+        if (isReturn(opCode)) break;
+
+        const auto next = offset + (hasOperand(opCode) ? 2 : 1);
+        if (isBranch(opCode)) {
+          const auto target = branchTarget(opCode, next, operand);
+          if (isUnconditionalBranch(opCode)) {
+            offset = target;
+            continue;
+          }
+
+          worklist.emplace_back(target, depth);
+        }
+
+        offset = next;
+      }
+    }
+  }
+
+  void Chunk::serialize(std::ostream& output) const {
+    output.write(magic, sizeof(magic));
+    writeRaw(output, formatVersion);
+    writeRaw(output, static_cast<std::uint32_t>(arity_));
+
+    writeRaw(output, static_cast<std::uint32_t>(bytecode_.size()));
+    output.write(reinterpret_cast<const char*>(bytecode_.data()), static_cast<std::streamsize>(bytecode_.size()));
+
+    writeRaw(output, static_cast<std::uint32_t>(constants_.size()));
+    for (const auto& constant : constants_) {
+      if (const auto string = std::get_if<ObjString*>(&constant)) {
+        const auto& chars = (*string)->chars;
+        writeRaw(output, ConstantTag::String);
+        writeRaw(output, static_cast<std::uint32_t>(chars.size()));
+        output.write(chars.data(), static_cast<std::streamsize>(chars.size()));
+      } else if (const auto number = std::get_if<double>(&constant)) {
+        writeRaw(output, ConstantTag::Number);
+        writeRaw(output, *number);
+      } else if (const auto boolean = std::get_if<bool>(&constant)) {
+        writeRaw(output, ConstantTag::Boolean);
+        writeRaw(output, static_cast<std::uint8_t>(*boolean));
+      } else if (const auto function = std::get_if<ObjFunction*>(&constant)) {
+        const auto& name = (*function)->name;
+        writeRaw(output, ConstantTag::Function);
+        writeRaw(output, static_cast<std::uint32_t>(name.size()));
+        output.write(name.data(), static_cast<std::streamsize>(name.size()));
+        (*function)->chunk->serialize(output);
+      } else {
+        writeRaw(output, ConstantTag::Nil);
+      }
+    }
+
+    writeRaw(output, static_cast<std::uint32_t>(positions_.size()));
+    for (const auto& [offset, position] : positions_) {
+      writeRaw(output, static_cast<std::uint32_t>(offset));
+      writeRaw(output, static_cast<std::uint32_t>(position.first));
+      writeRaw(output, static_cast<std::uint32_t>(position.second));
+    }
+  }
+
+  // Returns null if the input is truncated or was written by a different format version. Functions are verified as
+  // they are read, since a call trusts its function's chunk; the chunk itself is left for the caller to verify.
+  std::unique_ptr<Chunk> Chunk::deserialize(std::istream& input) {
+    return deserialize(input, 0);
+  }
+
+  std::unique_ptr<Chunk> Chunk::deserialize(std::istream& input, size_t depth) {
+    if (depth > maxFunctionDepth) return nullptr;
+
+    char header[sizeof(magic)];
+    std::uint8_t version = 0;
+    if (!input.read(header, sizeof(header)) || !std::equal(header, header + sizeof(header), magic)) return nullptr;
+    if (!readRaw(input, version) || version != formatVersion) return nullptr;
+
+    auto chunk = std::make_unique<Chunk>();
+
+    std::uint32_t arity = 0;
+    if (!readRaw(input, arity) || arity > std::numeric_limits<unsigned char>::max()) return nullptr;
+
+    chunk->arity_ = arity;
+
+    std::uint32_t size = 0;
+    if (!readRaw(input, size)) return nullptr;
+
+    if (!readBytes(input, chunk->bytecode_, size)) return nullptr;
+
+    std::uint32_t constantCount = 0;
+    if (!readRaw(input, constantCount) || constantCount > maxConstants) return nullptr;
+
+    for (std::uint32_t i = 0; i < constantCount; ++i) {
+      auto tag = ConstantTag::Nil;
+      if (!readRaw(input, tag)) return nullptr;
+
+      switch (tag) {
+        case ConstantTag::Nil:
+          chunk->constants_.emplace_back();
+          break;
+        case ConstantTag::Boolean: {
+          std::uint8_t boolean = 0;
+          if (!readRaw(input, boolean)) return nullptr;
+
+          chunk->constants_.emplace_back(boolean != 0);
+        } break;
+        case ConstantTag::Number: {
+          auto number = 0.0;
+          if (!readRaw(input, number)) return nullptr;
+
+          if (chunk->addConstant(number) != i) return nullptr;
+        } break;
+        case ConstantTag::String: {
+          std::uint32_t length = 0;
+          if (!readRaw(input, length)) return nullptr;
+
+          std::string string {};
+          if (!readBytes(input, string, length)) return nullptr;
+
+          // Numbers and strings are unique within a chunk, so a repeated one means the file is corrupt.
+          if (chunk->addString(string) != i) return nullptr;
+        } break;
+        case ConstantTag::Function: {
+          std::uint32_t length = 0;
+          if (!readRaw(input, length)) return nullptr;
+
+          std::string name {};
+          if (!readBytes(input, name, length)) return nullptr;
+
+          std::shared_ptr<Chunk> function = deserialize(input, depth + 1);
+          if (!function || findVerificationProblem(*function)) return nullptr;
+
+          function->setVerified(true);
+          chunk->addFunction(std::make_shared<ObjFunction>(std::move(name), std::move(function)));
+        } break;
+        default:
+          return nullptr;
+      }
+    }
+
+    std::uint32_t positionCount = 0;
+    if (!readRaw(input, positionCount)) return nullptr;
+
+    for (std::uint32_t i = 0; i < positionCount; ++i) {
+      std::uint32_t offset = 0;
+      std::uint32_t line = 0;
+      std::uint32_t column = 0;
+      if (!readRaw(input, offset) || !readRaw(input, line) || !readRaw(input, column)) return nullptr;
+
+      chunk->positions_.emplace(offset, std::make_pair(line, column));
+    }
+
+    chunk->trackStackDepth(0);
+    return chunk;
+  }
 }
@@ -1,17 +1,20 @@
 #pragma once
 
+#include "object.h"
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
-#include <variant>
 #include <vector>
 
 namespace Lox {
   struct Token;
 
-  using Value = std::variant<std::monostate, bool, double, std::string>;
-
   enum class OpCode : unsigned char {
     Constant,
     Nil,
@@ -35,31 +38,174 @@ namespace Lox {
     Divide,
     Negative,
     Not,
+    AddNumber,
+    LessNumber,
+    NegateNumber,
     Print,
     Jump,
     JumpIfTrue,
     JumpIfFalse,
+    PopJumpIfTrue,
+    PopJumpIfFalse,
     Loop,
+    PopLoopIfTrue,
+    Call,
+    ReturnValue,
     Return
   };
 
+  // Branch operands are unsigned distances from the next instruction; only Loop and PopLoopIfTrue jump backwards.
+  constexpr bool isBranch(OpCode opCode) {
+    switch (opCode) {
+      case OpCode::Jump:
+      case OpCode::JumpIfTrue:
+      case OpCode::JumpIfFalse:
+      case OpCode::PopJumpIfTrue:
+      case OpCode::PopJumpIfFalse:
+      case OpCode::Loop:
+      case OpCode::PopLoopIfTrue:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  constexpr bool isBackwardBranch(OpCode opCode) { return opCode == OpCode::Loop || opCode == OpCode::PopLoopIfTrue; }
+  constexpr bool isUnconditionalBranch(OpCode opCode) { return opCode == OpCode::Jump || opCode == OpCode::Loop; }
+
+  // Return ends the program; ReturnValue ends a function call, handing the value on top of the stack to the caller.
+  constexpr bool isReturn(OpCode opCode) { return opCode == OpCode::ReturnValue || opCode == OpCode::Return; }
+
+  constexpr size_t branchTarget(OpCode opCode, size_t next, size_t distance) {
+    return isBackwardBranch(opCode) ? next - distance : next + distance;
+  }
+
+  constexpr bool hasOperand(OpCode opCode) {
+    return
+      opCode == OpCode::Constant ||
+      opCode == OpCode::SetLocal ||
+      opCode == OpCode::GetLocal ||
+      opCode == OpCode::Call ||
+      isBranch(opCode);
+  }
+
+  struct StackEffect {
+    size_t pops;
+    size_t pushes;
+  };
+
+  // Only Call's effect depends on its operand, the number of arguments it passes.
+  constexpr StackEffect stackEffect(OpCode opCode, size_t operand) {
+    switch (opCode) {
+      case OpCode::Constant:
+      case OpCode::Nil:
+      case OpCode::True:
+      case OpCode::False:
+      case OpCode::GetLocal:
+        return { 0, 1 };
+      case OpCode::Pop:
+      case OpCode::Print:
+      case OpCode::PopJumpIfTrue:
+      case OpCode::PopJumpIfFalse:
+      case OpCode::PopLoopIfTrue:
+      case OpCode::ReturnValue:
+        return { 1, 0 };
+      case OpCode::DefineGlobal:
+        return { 2, 0 };
+      case OpCode::SetGlobal:
+      case OpCode::Equal:
+      case OpCode::NotEqual:
+      case OpCode::Greater:
+      case OpCode::GreaterEqual:
+      case OpCode::Less:
+      case OpCode::LessEqual:
+      case OpCode::Add:
+      case OpCode::Subtract:
+      case OpCode::Multiply:
+      case OpCode::Divide:
+      case OpCode::AddNumber:
+      case OpCode::LessNumber:
+        return { 2, 1 };
+      case OpCode::GetGlobal:
+      case OpCode::SetLocal:
+      case OpCode::Negative:
+      case OpCode::Not:
+      case OpCode::NegateNumber:
+      case OpCode::JumpIfTrue:
+      case OpCode::JumpIfFalse:
+        return { 1, 1 };
+      case OpCode::Call:
+        return { operand + 1, 1 };
+      case OpCode::Jump:
+      case OpCode::Loop:
+      case OpCode::Return:
+        return { 0, 0 };
+    }
+
+    return { 0, 0 };
+  }
+
+  // Not copyable: string constants point into the chunk's own storage, and so does the index that interns them.
   class Chunk {
   public:
+    Chunk() = default;
+    Chunk(const Chunk&) = delete;
+    Chunk& operator=(const Chunk&) = delete;
+
     constexpr std::byte read(size_t offset) const { return bytecode_[offset]; }
     void write(std::byte byte) { bytecode_.push_back(byte); }
     void write(OpCode opCode, const Token& token);
+    void write(OpCode opCode, std::pair<unsigned, unsigned> position);
     void patch(size_t offset, std::byte byte) { bytecode_[offset] = byte; }
+    void truncate(size_t size);
+    void clear();
 
     constexpr size_t size() const noexcept { return bytecode_.size(); }
 
-    Value getConstant(size_t index) const { return constants_[index]; }
+    const Value& getConstant(size_t index) const { return constants_[index]; }
+    size_t constantCount() const noexcept { return constants_.size(); }
+    // Numbers and strings are deduplicated. String and function constants must go through addString and addFunction,
+    // which give the chunk ownership of them.
     size_t addConstant(Value&& value);
+    size_t addString(std::string_view string);
+    size_t addFunction(std::shared_ptr<ObjFunction> function);
+    // Adds a constant of another chunk: strings are copied and functions shared.
+    size_t copyConstant(const Value& constant);
+    // Drops the constants added after the first count, which no code may still refer to.
+    void truncateConstants(size_t count);
+
+    // A function's chunk starts with its arguments on the stack, in local slots 0 to arity - 1.
+    constexpr size_t arity() const noexcept { return arity_; }
+    void setArity(size_t arity) noexcept { arity_ = arity; }
 
     std::pair<unsigned, unsigned> getPosition(size_t offset) const { return positions_.find(offset)->second; }
+    bool hasPosition(size_t offset) const { return positions_.count(offset) > 0; }
+
+    // Walks every path from entry, which must begin with only the arguments on the stack, and raises maxStackDepth
+    // to the deepest stack reached; the VM reserves that much before running the chunk.
+    void trackStackDepth(size_t entry);
+    constexpr size_t maxStackDepth() const noexcept { return maxStackDepth_; }
+
+    // Set once the code has passed the verifier; whoever changes the code afterwards must verify it again.
+    constexpr bool isVerified() const noexcept { return isVerified_; }
+    void setVerified(bool isVerified) noexcept { isVerified_ = isVerified; }
+
+    // The serialized form uses native byte order and is meant for caches on the same machine.
+    void serialize(std::ostream& output) const;
+    static std::unique_ptr<Chunk> deserialize(std::istream& input);
 
   private:
+    static std::unique_ptr<Chunk> deserialize(std::istream& input, size_t depth);
+
     std::vector<std::byte> bytecode_ {};
     std::vector<Value> constants_ {};
+    std::deque<ObjString> strings_ {};
+    std::vector<std::shared_ptr<ObjFunction>> functions_ {};
     std::unordered_map<size_t, std::pair<unsigned, unsigned>> positions_ {};
+    std::unordered_map<std::string_view, size_t> stringIndices_ {};
+    std::unordered_map<std::uint64_t, size_t> numberIndices_ {};
+    size_t arity_ { 0 };
+    size_t maxStackDepth_ { 0 };
+    bool isVerified_ { false };
   };
 }
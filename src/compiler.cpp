@@ -1,7 +1,10 @@
 #include "compiler.h"
 
 #include "error-reporter.h"
-#include <cstdlib>
+#include "optimizer.h"
+#include "type-inference.h"
+#include "verifier.h"
+#include <charconv>
 #include <limits>
 #include <stdexcept>
 #include <unordered_set>
@@ -21,23 +24,83 @@ namespace Lox {
   };
 
   std::unique_ptr<Chunk> Compiler::compile(std::string_view source, unsigned line) {
+    const auto start = std::chrono::steady_clock::now();
+    auto chunk = std::make_unique<Chunk>();
+    compileProgram(*chunk, source, line);
+
+    if (shouldOptimize_ && errorReporter_.errorCount() == 0) {
+      static constexpr auto isProgram = true;
+      chunk = Optimizer {}.optimize(std::move(chunk), isProgram);
+    }
+    chunk->trackStackDepth(0);
+    if (errorReporter_.errorCount() == 0) chunk->setVerified(!findVerificationProblem(*chunk));
+    if (chunk->isVerified()) specializeTypes(*chunk);
+
+    recordMetrics(start, chunk->size(), chunk->constantCount());
+    return chunk;
+  }
+
+  void Compiler::append(Chunk& chunk, std::string_view source, unsigned line) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto size = chunk.size();
+    const auto constantCount = chunk.constantCount();
+    const auto wasVerified = size == 0 || chunk.isVerified();
+    compileProgram(chunk, source, line);
+    chunk.trackStackDepth(size);
+    if (errorReporter_.errorCount() == 0) chunk.setVerified(wasVerified && !findVerificationProblem(chunk, size));
+    if (errorReporter_.errorCount() == 0 && chunk.isVerified()) specializeTypes(chunk, size);
+
+    recordMetrics(start, chunk.size() - size, chunk.constantCount() - constantCount);
+  }
+
+  void Compiler::begin(std::string_view source, unsigned line) {
     scanner_.initialize(source, line);
-    chunk_ = std::make_unique<Chunk>();
     advance();
+  }
 
-    while (!isAtEnd()) parseStatement();
+  bool Compiler::compileNext(Chunk& chunk) {
+    if (isAtEnd()) return false;
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto size = chunk.size();
+    const auto constantCount = chunk.constantCount();
+    chunk_ = &chunk;
+    parseStatement();
 
     emit(OpCode::Return, peek_);
-    return std::move(chunk_);
+    chunk_ = nullptr;
+    chunk.trackStackDepth(size);
+    if (errorReporter_.errorCount() == 0) chunk.setVerified((size == 0 || chunk.isVerified()) && !findVerificationProblem(chunk, size));
+    if (errorReporter_.errorCount() == 0 && chunk.isVerified()) specializeTypes(chunk, size);
+
+    recordMetrics(start, chunk.size() - size, chunk.constantCount() - constantCount);
+    return true;
   }
 
   void Compiler::reset() {
     locals_.clear();
     unpatchedBreaks_.clear();
+    enclosingLoops_.clear();
     pendingGet_.reset();
     pendingLocal_.reset();
     scopeDepth_ = 0;
-    loopDepth_ = 0;
+    loopScopeDepth_ = 0;
+  }
+
+  void Compiler::compileProgram(Chunk& chunk, std::string_view source, unsigned line) {
+    begin(source, line);
+    chunk_ = &chunk;
+
+    while (!isAtEnd()) parseStatement();
+
+    emit(OpCode::Return, peek_);
+    chunk_ = nullptr;
+  }
+
+  void Compiler::recordMetrics(std::chrono::steady_clock::time_point start, size_t bytecodeBytes, size_t constantCount) {
+    metrics_.compileTime += std::chrono::steady_clock::now() - start;
+    metrics_.bytecodeBytes += bytecodeBytes;
+    metrics_.constantCount += constantCount;
   }
 
   void Compiler::emit(OpCode opCode, const Token& token, std::optional<std::byte> argument) {
@@ -55,7 +118,10 @@ namespace Lox {
   }
 
   void Compiler::emitConstant(Value&& value, const Token& token) {
-    const auto index = chunk_->addConstant(std::move(value));
+    emitConstantIndex(chunk_->addConstant(std::move(value)), token);
+  }
+
+  void Compiler::emitConstantIndex(size_t index, const Token& token) {
     if (index > std::numeric_limits<unsigned char>::max()) {
       throw std::overflow_error { "Too many constants in one chunk!" };
     }
@@ -63,10 +129,20 @@ namespace Lox {
     emit(OpCode::Constant, token, static_cast<std::byte>(index));
   }
 
+  void Compiler::emitIdentifier(const Token& identifier) {
+    emitConstantIndex(chunk_->addString(identifier.lexeme), identifier);
+  }
+
   void Compiler::emitPop() {
     emit(OpCode::Pop, peek_);
   }
 
+  size_t Compiler::target() {
+    if (pendingGet_) emitPendingGet();
+
+    return chunk_->size();
+  }
+
   size_t Compiler::emitJump(OpCode opCode, const Token& token) {
     emit(opCode, token, static_cast<std::byte>(0xff));
     return target();
@@ -81,13 +157,51 @@ namespace Lox {
     chunk_->patch(offset - 1, static_cast<std::byte>(distance));
   }
 
-  void Compiler::emitLoop(size_t offset, const Token& token) {
+  void Compiler::emitLoop(OpCode opCode, size_t offset, const Token& token) {
     const auto distance = target() + 2 - offset;
     if (distance > std::numeric_limits<unsigned char>::max()) {
       throw std::overflow_error { "Jump distance too large!" };
     }
 
-    emit(OpCode::Loop, token, static_cast<std::byte>(distance));
+    emit(opCode, token, static_cast<std::byte>(distance));
+  }
+
+  Compiler::Fragment Compiler::copyFragment(size_t start) {
+    Fragment fragment {};
+    const auto end = target();
+    for (auto offset = start; offset < end; ++offset) {
+      fragment.bytecode.push_back(chunk_->read(offset));
+      fragment.positions.push_back(chunk_->hasPosition(offset) ? chunk_->getPosition(offset) : std::make_pair(0u, 0u));
+    }
+
+    return fragment;
+  }
+
+  void Compiler::emitFragment(const Fragment& fragment) {
+    if (pendingGet_) emitPendingGet();
+
+    for (size_t i = 0; i < fragment.bytecode.size();) {
+      const auto opCode = static_cast<OpCode>(fragment.bytecode[i]);
+      chunk_->write(opCode, fragment.positions[i]);
+      if (hasOperand(opCode)) chunk_->write(fragment.bytecode[i + 1]);
+
+      i += hasOperand(opCode) ? 2 : 1;
+    }
+  }
+
+  // Breaks belong to the innermost loop; they jump to its exit after popping the locals declared inside it.
+  void Compiler::beginLoop() {
+    enclosingLoops_.emplace_back(std::move(unpatchedBreaks_), loopScopeDepth_);
+    unpatchedBreaks_.clear();
+    loopScopeDepth_ = scopeDepth_;
+  }
+
+  void Compiler::endLoop() {
+    for (auto target : unpatchedBreaks_) patchJump(target);
+
+    unpatchedBreaks_ = std::move(enclosingLoops_.back().first);
+    loopScopeDepth_ = enclosingLoops_.back().second;
+    enclosingLoops_.pop_back();
   }
 
   void Compiler::declareLocal(const Token& identifier) {
@@ -95,20 +209,18 @@ namespace Lox {
       throw std::overflow_error { "Too many locals in one function!" };
     }
 
-    for (auto it = locals_.crbegin(); it != locals_.crend() && it->second == scopeDepth_; ++it) {
-      if (it->first == identifier.lexeme) {
-        throw LoxError {
-          identifier,
-          "Identifier '" + std::string { identifier.lexeme } + "' is already declared in this scope."
-        };
-      }
+    if (locals_.isDeclaredAt(identifier.lexeme, scopeDepth_)) {
+      throw LoxError {
+        identifier,
+        "Identifier '" + std::string { identifier.lexeme } + "' is already declared in this scope."
+      };
     }
 
     pendingLocal_ = identifier.lexeme;
   }
 
   void Compiler::definePendingLocal() {
-    locals_.emplace_back(*pendingLocal_, scopeDepth_);
+    locals_.declare(*pendingLocal_, scopeDepth_);
     pendingLocal_.reset();
   }
 
@@ -121,10 +233,18 @@ namespace Lox {
       };
     }
 
-    for (auto i = locals_.size(); i-- > 0;) {
-      if (locals_[i].first == identifier.lexeme) {
-        pendingGet_ = { OpCode::GetLocal, identifier, static_cast<std::byte>(i) };
-        return;
+    if (const auto slot = locals_.resolve(identifier.lexeme)) {
+      pendingGet_ = { OpCode::GetLocal, identifier, static_cast<std::byte>(*slot) };
+      return;
+    }
+
+    // Without closures, a local of an enclosing function cannot be reached from inside a nested one.
+    for (const auto& function : enclosingFunctions_) {
+      if (function.locals.resolve(identifier.lexeme) || function.pendingLocal == identifier.lexeme) {
+        throw LoxError {
+          identifier,
+          "Identifier '" + std::string { identifier.lexeme } + "' is a local of an enclosing function."
+        };
       }
     }
   }
@@ -134,12 +254,44 @@ namespace Lox {
   }
 
   void Compiler::endScope() {
-    while (locals_.size() > 0 && locals_.back().second == scopeDepth_) {
-      locals_.pop_back();
-      emitPop();
-    }
-
     scopeDepth_--;
+    for (auto count = locals_.popScopesDeeperThan(scopeDepth_); count > 0; --count) emitPop();
+  }
+
+  // A function body is compiled into its own chunk, with the enclosing code's state set aside until it is done.
+  void Compiler::beginFunction(Chunk& chunk) {
+    if (pendingGet_) emitPendingGet();
+
+    enclosingFunctions_.push_back({
+      chunk_,
+      std::move(locals_),
+      std::move(unpatchedBreaks_),
+      std::move(enclosingLoops_),
+      pendingLocal_,
+      scopeDepth_,
+      loopScopeDepth_
+    });
+
+    chunk_ = &chunk;
+    locals_.clear();
+    unpatchedBreaks_.clear();
+    enclosingLoops_.clear();
+    pendingLocal_.reset();
+    scopeDepth_ = 1;
+    loopScopeDepth_ = 0;
+  }
+
+  void Compiler::endFunction() {
+    auto& enclosing = enclosingFunctions_.back();
+    pendingGet_.reset();
+    chunk_ = enclosing.chunk;
+    locals_ = std::move(enclosing.locals);
+    unpatchedBreaks_ = std::move(enclosing.unpatchedBreaks);
+    enclosingLoops_ = std::move(enclosing.enclosingLoops);
+    pendingLocal_ = enclosing.pendingLocal;
+    scopeDepth_ = enclosing.scopeDepth;
+    loopScopeDepth_ = enclosing.loopScopeDepth;
+    enclosingFunctions_.pop_back();
   }
 
   void Compiler::parseStatement(bool inBlock) {
@@ -148,6 +300,9 @@ namespace Lox {
         case TokenType::Var:
           parseVariable();
           return;
+        case TokenType::Fun:
+          parseFunction();
+          return;
         default:
           parseNonDeclaration();
           return;
@@ -162,7 +317,7 @@ namespace Lox {
     const auto keyword = advance();
     const auto identifier = expectIdentifier();
     if (!scopeDepth_) {
-      emitConstant(std::string { identifier.lexeme }, identifier);
+      emitIdentifier(identifier);
     } else {
       declareLocal(identifier);
     }
@@ -181,11 +336,83 @@ namespace Lox {
     }
   }
 
+  // Like variables, functions declared at the top level are globals and those declared in a block are locals.
+  void Compiler::parseFunction() {
+    const auto keyword = advance();
+    const auto identifier = expectIdentifier();
+    if (!scopeDepth_) {
+      emitIdentifier(identifier);
+    } else {
+      declareLocal(identifier);
+    }
+
+    emitConstantIndex(chunk_->addFunction(compileFunction(identifier)), identifier);
+    if (!scopeDepth_) {
+      emit(OpCode::DefineGlobal, keyword);
+    } else {
+      definePendingLocal();
+    }
+  }
+
+  // Parameters are the function's first locals, in the slots the arguments of a call occupy.
+  std::shared_ptr<ObjFunction> Compiler::compileFunction(const Token& name) {
+    auto chunk = std::make_unique<Chunk>();
+    beginFunction(*chunk);
+
+    try {
+      expect(TokenType::LeftParen, "Expected '(' after function name.");
+      if (!peekIs(TokenType::RightParen)) {
+        do {
+          if (locals_.size() == std::numeric_limits<unsigned char>::max()) {
+            throw LoxError { peek_, "Too many parameters in one function." };
+          }
+
+          declareLocal(expectIdentifier());
+          definePendingLocal();
+        } while (advanceIf(TokenType::Comma));
+      }
+
+      expect(TokenType::RightParen, "Expected ')' after parameters.");
+      expect(TokenType::LeftBrace, "Expected '{' before function body.");
+      chunk->setArity(locals_.size());
+
+      static constexpr auto inBlock = true;
+      while (!peekIs(TokenType::RightBrace) && !isAtEnd()) parseStatement(inBlock);
+
+      const auto end = peek_;
+      expect(TokenType::RightBrace, "Expected '}'.");
+      emit(OpCode::Nil, end);
+      emit(OpCode::ReturnValue, end);
+    } catch (...) {
+      endFunction();
+      throw;
+    }
+
+    endFunction();
+    metrics_.bytecodeBytes += chunk->size();
+    metrics_.constantCount += chunk->constantCount();
+
+    // Calls trust a function's chunk, so code that fails the verifier here is a compiler bug.
+    if (errorReporter_.errorCount() == 0) {
+      if (shouldOptimize_) chunk = Optimizer {}.optimize(std::move(chunk));
+      chunk->trackStackDepth(0);
+      if (const auto problem = findVerificationProblem(*chunk)) throw std::logic_error { "Function failed verification: " + *problem };
+
+      chunk->setVerified(true);
+      specializeTypes(*chunk);
+    }
+
+    return std::make_shared<ObjFunction>(std::string { name.lexeme }, std::move(chunk));
+  }
+
   void Compiler::parseNonDeclaration() {
     switch (peek_.type) {
       case TokenType::Break:
         parseBreak();
         return;
+      case TokenType::Return:
+        parseReturn();
+        return;
       case TokenType::For:
         parseFor();
         return;
@@ -209,12 +436,30 @@ namespace Lox {
 
   void Compiler::parseBreak() {
     const auto token = advance();
-    if (!loopDepth_) throw LoxError { token, "'break' used outside of loop." };
+    if (enclosingLoops_.empty()) throw LoxError { token, "'break' used outside of loop." };
 
+    for (auto count = locals_.countDeeperThan(loopScopeDepth_); count > 0; --count) emitPop();
     unpatchedBreaks_.push_back(emitJump(OpCode::Jump, token));
     expectSemicolon();
   }
 
+  // The frame is discarded on return, so locals need no pops.
+  void Compiler::parseReturn() {
+    const auto token = advance();
+    if (enclosingFunctions_.empty()) throw LoxError { token, "'return' used outside of function." };
+
+    if (peekIs(TokenType::Semicolon)) {
+      emit(OpCode::Nil, token);
+    } else {
+      parseExpression();
+    }
+
+    expectSemicolon();
+    emit(OpCode::ReturnValue, token);
+  }
+
+  // Loops are rotated: a guard skips the loop when the condition starts out false, and a copy of the condition
+  // after the body branches back while it holds. The increment moves after the body as well.
   void Compiler::parseFor() {
     const auto token = advance();
     beginScope();
@@ -226,67 +471,62 @@ namespace Lox {
       parseExpressionStatement();
     }
 
-    const auto startTarget = target();
-
+    auto condition = static_cast<std::optional<Fragment>>(std::nullopt);
     auto endTarget = static_cast<std::optional<size_t>>(std::nullopt);
     if (!advanceIf(TokenType::Semicolon)) {
+      const auto conditionStart = target();
       parseExpression();
       expectSemicolon();
-      endTarget = emitJump(OpCode::JumpIfFalse, token);
-
-      emitPop();
+      condition = copyFragment(conditionStart);
+      endTarget = emitJump(OpCode::PopJumpIfFalse, token);
     }
 
-    auto incrementTarget = static_cast<std::optional<size_t>>(std::nullopt);
+    auto increment = Fragment {};
     if (!advanceIf(TokenType::RightParen)) {
-      const auto bodyTarget = emitJump(OpCode::Jump, token);
-
-      incrementTarget = target();
+      const auto incrementStart = target();
       parseExpression();
       emitPop();
       expect(TokenType::RightParen, "Expected ')' after 'for' loop header.");
-      emitLoop(startTarget, token);
-
-      patchJump(bodyTarget);
+      increment = copyFragment(incrementStart);
+      chunk_->truncate(incrementStart);
     }
 
-    loopDepth_++;
+    const auto bodyTarget = target();
+    beginLoop();
     parseNonDeclaration();
-    loopDepth_--;
-    emitLoop(incrementTarget ? *incrementTarget : startTarget, token);
+    emitFragment(increment);
 
-    if (endTarget) {
+    if (condition) {
+      emitFragment(*condition);
+      emitLoop(OpCode::PopLoopIfTrue, bodyTarget, token);
       patchJump(*endTarget);
-      emitPop();
+    } else {
+      emitLoop(OpCode::Loop, bodyTarget, token);
     }
 
-    for (auto target : unpatchedBreaks_) patchJump(target);
-    unpatchedBreaks_.clear();
-
+    endLoop();
     endScope();
   }
 
   void Compiler::parseWhile() {
     const auto token = advance();
 
-    const auto startTarget = target();
     expect(TokenType::LeftParen, "Expected '(' before 'while' condition.");
+    const auto conditionStart = target();
     parseExpression();
     expect(TokenType::RightParen, "Expected ')' after 'while' condition.");
 
-    const auto endTarget = emitJump(OpCode::JumpIfFalse, token);
+    const auto condition = copyFragment(conditionStart);
+    const auto endTarget = emitJump(OpCode::PopJumpIfFalse, token);
+    const auto bodyTarget = target();
 
-    emitPop();
-    loopDepth_++;
+    beginLoop();
     parseNonDeclaration();
-    loopDepth_--;
-    emitLoop(startTarget, token);
+    emitFragment(condition);
+    emitLoop(OpCode::PopLoopIfTrue, bodyTarget, token);
 
     patchJump(endTarget);
-    emitPop();
-
-    for (auto target : unpatchedBreaks_) patchJump(target);
-    unpatchedBreaks_.clear();
+    endLoop();
   }
 
   void Compiler::parseIf() {
@@ -295,15 +535,16 @@ namespace Lox {
     parseExpression();
     expect(TokenType::RightParen, "Expected ')' after 'if' condition.");
 
-    const auto elseTarget = emitJump(OpCode::JumpIfFalse, token);
-
-    emitPop();
+    const auto elseTarget = emitJump(OpCode::PopJumpIfFalse, token);
     parseNonDeclaration();
-    const auto endTarget = emitJump(OpCode::Jump, token);
+    if (!advanceIf(TokenType::Else)) {
+      patchJump(elseTarget);
+      return;
+    }
 
+    const auto endTarget = emitJump(OpCode::Jump, token);
     patchJump(elseTarget);
-    emitPop();
-    if (advanceIf(TokenType::Else)) parseNonDeclaration();
+    parseNonDeclaration();
 
     patchJump(endTarget);
   }
@@ -455,13 +696,35 @@ namespace Lox {
     };
 
     const auto op = unaries.find(peek_.type);
-    if (op == unaries.cend()) return parsePrimary();
+    if (op == unaries.cend()) return parseCall();
 
     const auto token = advance();
     parseUnary();
     emit(op->second, token);
   }
 
+  void Compiler::parseCall() {
+    parsePrimary();
+    while (peekIs(TokenType::LeftParen)) {
+      const auto token = advance();
+
+      size_t argumentCount = 0;
+      if (!peekIs(TokenType::RightParen)) {
+        do {
+          if (argumentCount == std::numeric_limits<unsigned char>::max()) {
+            throw LoxError { peek_, "Too many arguments in one call." };
+          }
+
+          parseExpression();
+          argumentCount++;
+        } while (advanceIf(TokenType::Comma));
+      }
+
+      expect(TokenType::RightParen, "Expected ')' after arguments.");
+      emit(OpCode::Call, token, static_cast<std::byte>(argumentCount));
+    }
+  }
+
   void Compiler::parsePrimary() {
     switch (peek_.type) {
       case TokenType::LeftParen:
@@ -506,18 +769,19 @@ namespace Lox {
     resolveLocal(identifier);
     if (pendingGet_) return;
 
-    emitConstant(std::string { identifier.lexeme }, identifier);
+    emitIdentifier(identifier);
     pendingGet_ = { OpCode::GetGlobal, identifier, std::nullopt };
   }
 
   void Compiler::parseString() {
-    const auto string = std::string { peek_.lexeme.cbegin() + 1, peek_.lexeme.cend() - 1 };
+    const auto string = peek_.lexeme.substr(1, peek_.lexeme.size() - 2);
     const auto token = advance();
-    emitConstant(string, token);
+    emitConstantIndex(chunk_->addString(string), token);
   }
 
   void Compiler::parseNumber() {
-    const auto number = std::strtod(peek_.lexeme.data(), nullptr);
+    auto number = 0.0;
+    std::from_chars(peek_.lexeme.data(), peek_.lexeme.data() + peek_.lexeme.size(), number);
     const auto token = advance();
     emitConstant(number, token);
   }
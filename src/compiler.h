@@ -1,8 +1,11 @@
 #pragma once
 
 #include "chunk.h"
+#include "local-table.h"
+#include "metrics.h"
 #include "scanner.h"
 #include "token.h"
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <optional>
@@ -17,13 +20,25 @@ namespace Lox {
 
   class Compiler {
   public:
-    explicit Compiler(ErrorReporter& errorReporter)
-      : errorReporter_(errorReporter) {}
+    explicit Compiler(ErrorReporter& errorReporter, bool shouldOptimize = false)
+      : errorReporter_(errorReporter), shouldOptimize_(shouldOptimize) {}
 
     std::unique_ptr<Chunk> compile(std::string_view source, unsigned line);
 
+    // Appends to an existing chunk; the new code starts at the chunk's previous size.
+    void append(Chunk& chunk, std::string_view source, unsigned line);
+
+    // Streaming mode: after begin, each compileNext call compiles one top-level statement into a self-contained
+    // chunk, returning false once the source is exhausted.
+    void begin(std::string_view source, unsigned line);
+    bool compileNext(Chunk& chunk);
+
     void reset();
 
+    // Accumulated over every compilation since construction or the last resetMetrics.
+    constexpr const CompileMetrics& metrics() const noexcept { return metrics_; }
+    void resetMetrics() noexcept { metrics_ = {}; }
+
   private:
     using CompilerMethod = std::function<void(Compiler*)>;
     using OperatorMap = std::unordered_map<TokenType, OpCode>;
@@ -34,26 +49,57 @@ namespace Lox {
       std::optional<std::byte> argument;
     };
 
+    // Code lifted out of the chunk to be emitted again elsewhere; its jumps are relative, so it can move as a unit.
+    struct Fragment {
+      std::vector<std::byte> bytecode;
+      std::vector<std::pair<unsigned, unsigned>> positions;
+    };
+
+    // What the compiler sets aside while it compiles a function declared inside the code it was compiling.
+    struct FunctionState {
+      Chunk* chunk;
+      LocalTable locals;
+      std::vector<size_t> unpatchedBreaks;
+      std::vector<std::pair<std::vector<size_t>, unsigned>> enclosingLoops;
+      std::optional<std::string_view> pendingLocal;
+      unsigned scopeDepth;
+      unsigned loopScopeDepth;
+    };
+
+    void compileProgram(Chunk& chunk, std::string_view source, unsigned line);
+    void recordMetrics(std::chrono::steady_clock::time_point start, size_t bytecodeBytes, size_t constantCount);
+
     void emit(OpCode opCode, const Token& token, std::optional<std::byte> argument = std::nullopt);
     void emitPendingGet();
     void emitConstant(Value&& value, const Token& token);
+    void emitConstantIndex(size_t index, const Token& token);
+    void emitIdentifier(const Token& identifier);
     void emitPop();
 
-    constexpr size_t target() const noexcept { return chunk_->size(); }
+    size_t target();
     size_t emitJump(OpCode opCode, const Token& token);
     void patchJump(size_t offset);
-    void emitLoop(size_t offset, const Token& token);
+    void emitLoop(OpCode opCode, size_t offset, const Token& token);
+    Fragment copyFragment(size_t start);
+    void emitFragment(const Fragment& fragment);
+    void beginLoop();
+    void endLoop();
 
     void declareLocal(const Token& identifier);
     void definePendingLocal();
     void resolveLocal(const Token& identifier);
     void beginScope();
     void endScope();
+    void beginFunction(Chunk& chunk);
+    void endFunction();
 
     void parseStatement(bool inBlock = false);
     void parseVariable();
+    void parseFunction();
+    std::shared_ptr<ObjFunction> compileFunction(const Token& name);
     void parseNonDeclaration();
     void parseBreak();
+    void parseReturn();
     void parseFor();
     void parseWhile();
     void parseIf();
@@ -72,6 +118,7 @@ namespace Lox {
     void parseMultiplicative();
     void parseBinary(const CompilerMethod& parseOperand, const OperatorMap& operators);
     void parseUnary();
+    void parseCall();
     void parsePrimary();
     void parseParenthesized();
     void parseIdentifier();
@@ -91,18 +138,23 @@ namespace Lox {
     constexpr void error() const;
 
     ErrorReporter& errorReporter_;
+    const bool shouldOptimize_;
 
     Scanner scanner_ {};
-    std::unique_ptr<Chunk> chunk_;
-    std::vector<std::pair<std::string_view, unsigned>> locals_ {};
+    Chunk* chunk_ { nullptr };
+    LocalTable locals_ {};
 
     std::vector<size_t> unpatchedBreaks_;
+    std::vector<std::pair<std::vector<size_t>, unsigned>> enclosingLoops_;
+    std::vector<FunctionState> enclosingFunctions_;
 
     std::optional<Instruction> pendingGet_;
     std::optional<std::string_view> pendingLocal_;
 
     Token peek_ { TokenType::Eof, {}, 0, 0 };
     unsigned scopeDepth_ { 0 };
-    unsigned loopDepth_ { 0 };
+    unsigned loopScopeDepth_ { 0 };
+
+    CompileMetrics metrics_ {};
   };
 }
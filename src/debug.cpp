@@ -2,125 +2,218 @@
 #include "debug.h"
 
 #include "chunk.h"
+#include <algorithm>
+#include <cstdarg>
 #include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
 
 namespace Lox {
   void ChunkPrinter::print(const Chunk& chunk, std::string_view name) {
-    printf("== %s ==\n", name.data());
+    write("== %s ==\n", name.data());
 
     chunk_ = &chunk;
     offset_ = 0;
     while (offset_ < chunk_->size()) printInstruction();
 
-    printf("== end ==\n");
+    printConstantStats();
+    write("== end ==\n");
+
+    for (size_t i = 0; i < chunk.constantCount(); ++i) {
+      if (const auto function = std::get_if<ObjFunction*>(&chunk.getConstant(i))) {
+        print(*(*function)->chunk, (*function)->name);
+      }
+    }
+  }
+
+  // Formats like printf, into the printer's stream.
+  void ChunkPrinter::write(const char* format, ...) const {
+    va_list arguments;
+    va_start(arguments, format);
+    va_list measured;
+    va_copy(measured, arguments);
+    const auto length = std::vsnprintf(nullptr, 0, format, measured);
+    va_end(measured);
+
+    std::string text(static_cast<size_t>(std::max(length, 0)), '\0');
+    std::vsnprintf(text.data(), text.size() + 1, format, arguments);
+    va_end(arguments);
+    output_ << text;
+  }
+
+  void ChunkPrinter::printConstantStats() const {
+    size_t numberCount = 0;
+    size_t stringCount = 0;
+    size_t functionCount = 0;
+    size_t stringBytes = 0;
+    for (size_t i = 0; i < chunk_->constantCount(); ++i) {
+      const auto& constant = chunk_->getConstant(i);
+      if (const auto string = std::get_if<ObjString*>(&constant)) {
+        stringCount++;
+        stringBytes += (*string)->chars.size();
+      }
+      numberCount += std::holds_alternative<double>(constant);
+      functionCount += std::holds_alternative<ObjFunction*>(constant);
+    }
+
+    // A reference is shared when an earlier one already landed on its slot.
+    std::vector<size_t> hitCounts(chunk_->constantCount(), 0);
+    size_t referenceCount = 0;
+    size_t sharedCount = 0;
+    for (size_t offset = 0; offset < chunk_->size();) {
+      const auto opCode = static_cast<OpCode>(chunk_->read(offset));
+      if (opCode == OpCode::Constant) {
+        referenceCount++;
+        if (hitCounts[static_cast<size_t>(chunk_->read(offset + 1))]++ > 0) sharedCount++;
+      }
+
+      offset += hasOperand(opCode) ? 2 : 1;
+    }
+
+    const auto constantCount = chunk_->constantCount();
+    write(
+      "-- constants: %zu/256 (%zu numbers, %zu strings, %zu bytes, %zu functions), %zu references, %zu shared\n",
+      constantCount, numberCount, stringCount, stringBytes, functionCount, referenceCount, sharedCount
+    );
   }
 
   void ChunkPrinter::printInstruction() {
-    printf("%02zx", offset_);
+    write("%02zx", offset_);
 
     const auto position = chunk_->getPosition(offset_);
-    printf(" (%3u:%3u) ", position.first, position.second);
+    write(" (%3u:%3u) ", position.first, position.second);
 
     const auto opCode = static_cast<OpCode>(chunk_->read(offset_++));
     switch (opCode) {
       case OpCode::Constant: {
         const auto index = static_cast<size_t>(chunk_->read(offset_++));
-        const auto value = chunk_->getConstant(index);
-        if (const auto string = std::get_if<std::string>(&value)) {
-          printf("constant %02zx   # value: \"%s\"\n", index, string->c_str());
+        const auto& value = chunk_->getConstant(index);
+        if (const auto string = std::get_if<ObjString*>(&value)) {
+          write("constant %02zx   # value: \"%s\"\n", index, (*string)->chars.c_str());
         } else if (const auto number = std::get_if<double>(&value)) {
-          printf("constant %02zx   # value: %g\n", index, *number);
+          write("constant %02zx   # value: %g\n", index, *number);
+        } else if (const auto function = std::get_if<ObjFunction*>(&value)) {
+          write("constant %02zx   # value: <fn %s>\n", index, (*function)->name.c_str());
         }
       } break;
       case OpCode::Nil:
-        printf("nil\n");
+        write("nil\n");
         break;
       case OpCode::True:
-        printf("true\n");
+        write("true\n");
         break;
       case OpCode::False:
-        printf("false\n");
+        write("false\n");
         break;
       case OpCode::Pop:
-        printf("pop\n");
+        write("pop\n");
         break;
       case OpCode::DefineGlobal:
-        printf("define_global\n");
+        write("define_global\n");
         break;
       case OpCode::SetGlobal:
-        printf("set_global\n");
+        write("set_global\n");
         break;
       case OpCode::GetGlobal:
-        printf("get_global\n");
+        write("get_global\n");
         break;
       case OpCode::SetLocal: {
         const auto index = static_cast<size_t>(chunk_->read(offset_++));
-        printf("set_local %02zx\n", index);
+        write("set_local %02zx\n", index);
       } break;
       case OpCode::GetLocal: {
         const auto index = static_cast<size_t>(chunk_->read(offset_++));
-        printf("get_local %02zx\n", index);
+        write("get_local %02zx\n", index);
       } break;
       case OpCode::Equal:
-        printf("equal\n");
+        write("equal\n");
         break;
       case OpCode::NotEqual:
-        printf("not_equal\n");
+        write("not_equal\n");
         break;
       case OpCode::Greater:
-        printf("greater\n");
+        write("greater\n");
         break;
       case OpCode::GreaterEqual:
-        printf("greater_equal\n");
+        write("greater_equal\n");
         break;
       case OpCode::Less:
-        printf("less\n");
+        write("less\n");
         break;
       case OpCode::LessEqual:
-        printf("less_equal\n");
+        write("less_equal\n");
         break;
       case OpCode::Add:
-        printf("add\n");
+        write("add\n");
         break;
       case OpCode::Subtract:
-        printf("subtract\n");
+        write("subtract\n");
         break;
       case OpCode::Multiply:
-        printf("multiply\n");
+        write("multiply\n");
         break;
       case OpCode::Divide:
-        printf("divide\n");
+        write("divide\n");
         break;
       case OpCode::Negative:
-        printf("negative\n");
+        write("negative\n");
         break;
       case OpCode::Not:
-        printf("not\n");
+        write("not\n");
+        break;
+      case OpCode::AddNumber:
+        write("add_number\n");
+        break;
+      case OpCode::LessNumber:
+        write("less_number\n");
+        break;
+      case OpCode::NegateNumber:
+        write("negate_number\n");
         break;
       case OpCode::Print:
-        printf("print\n");
+        write("print\n");
         break;
       case OpCode::Jump: {
         const auto distance = static_cast<size_t>(chunk_->read(offset_++));
-        printf("jump %02zx       # ->%02zx\n", distance, offset_ + distance);
+        write("jump %02zx       # ->%02zx\n", distance, offset_ + distance);
       } break;
       case OpCode::JumpIfTrue: {
         const auto distance = static_cast<size_t>(chunk_->read(offset_++));
-        printf("jump_true %02zx  # ->%02zx\n", distance, offset_ + distance);
+        write("jump_true %02zx  # ->%02zx\n", distance, offset_ + distance);
       } break;
       case OpCode::JumpIfFalse: {
         const auto distance = static_cast<size_t>(chunk_->read(offset_++));
-        printf("jump_false %02zx # ->%02zx\n", distance, offset_ + distance);
+        write("jump_false %02zx # ->%02zx\n", distance, offset_ + distance);
+      } break;
+      case OpCode::PopJumpIfTrue: {
+        const auto distance = static_cast<size_t>(chunk_->read(offset_++));
+        write("pop_jump_true %02zx  # ->%02zx\n", distance, offset_ + distance);
+      } break;
+      case OpCode::PopJumpIfFalse: {
+        const auto distance = static_cast<size_t>(chunk_->read(offset_++));
+        write("pop_jump_false %02zx # ->%02zx\n", distance, offset_ + distance);
       } break;
       case OpCode::Loop: {
         const auto distance = static_cast<size_t>(chunk_->read(offset_++));
-        printf("loop %02zx       # ->%02zx\n", distance, offset_ - distance);
+        write("loop %02zx       # ->%02zx\n", distance, offset_ - distance);
+      } break;
+      case OpCode::PopLoopIfTrue: {
+        const auto distance = static_cast<size_t>(chunk_->read(offset_++));
+        write("pop_loop_true %02zx  # ->%02zx\n", distance, offset_ - distance);
       } break;
+      case OpCode::Call: {
+        const auto argumentCount = static_cast<size_t>(chunk_->read(offset_++));
+        write("call %02zx\n", argumentCount);
+      } break;
+      case OpCode::ReturnValue:
+        write("return_value\n");
+        break;
       case OpCode::Return:
-        printf("return\n");
+        write("return\n");
         break;
       default:
-        printf("unknown\n");
+        write("unknown\n");
         break;
     }
   }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <iosfwd>
 #include <string_view>
 
 namespace Lox {
@@ -7,11 +8,17 @@ namespace Lox {
 
   class ChunkPrinter {
   public:
+    explicit ChunkPrinter(std::ostream& output)
+      : output_(output) {}
+
     void print(const Chunk& chunk, std::string_view name);
 
   private:
     void printInstruction();
+    void printConstantStats() const;
+    void write(const char* format, ...) const;
 
+    std::ostream& output_;
     const Chunk* chunk_;
     size_t offset_ { 0 };
   };
@@ -1,7 +1,7 @@
 #include "error-reporter.h"
 
 #include <iomanip>
-#include <iostream>
+#include <ostream>
 
 namespace {
   constexpr auto resetText = "\033[0m";
@@ -16,7 +16,7 @@ namespace Lox {
 
   void ErrorReporter::report(unsigned line, unsigned column, const std::string& message, bool isDynamic) {
     const auto stage = isDynamic ? "runtime" : "syntax";
-    std::cerr
+    output_
       << redText << std::setw(8) << stage << " error  " << resetText
       << message
       << greyText << " (" << line << ':' << column << ")\n" << resetText;
@@ -24,9 +24,16 @@ namespace Lox {
     errorCount_++;
   }
 
+  void ErrorReporter::report(const std::string& message, bool isDynamic) {
+    const auto stage = isDynamic ? "runtime" : "syntax";
+    output_ << redText << std::setw(8) << stage << " error  " << resetText << message << '\n';
+
+    errorCount_++;
+  }
+
   void ErrorReporter::displayErrorCount() const {
     const auto suffix = errorCount_ == 1 ? "" : "s";
-    std::cerr << errorCount_ << " error" << suffix << " identified.\n";
+    output_ << errorCount_ << " error" << suffix << " identified.\n";
   }
 
   void ErrorReporter::reset() {
@@ -2,6 +2,7 @@
 
 #include "token.h"
 #include <exception>
+#include <iosfwd>
 #include <string>
 #include <utility>
 
@@ -20,14 +21,20 @@ namespace Lox {
 
   class ErrorReporter {
   public:
+    explicit ErrorReporter(std::ostream& output)
+      : output_(output) {}
+
     constexpr unsigned errorCount() const { return errorCount_; }
 
     void report(const LoxError& error, bool isDynamic = false);
     void report(unsigned line, unsigned column, const std::string& message, bool isDynamic = false);
+    // For errors that belong to no source position.
+    void report(const std::string& message, bool isDynamic = false);
     void displayErrorCount() const;
     void reset();
 
   private:
+    std::ostream& output_;
     unsigned errorCount_ { 0 };
   };
 }
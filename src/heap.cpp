@@ -0,0 +1,75 @@
+#include "heap.h"
+
+#include <algorithm>
+
+namespace Lox {
+  static size_t sizeOf(const Obj& object) {
+    switch (object.type) {
+      case ObjType::String:
+        return sizeof(ObjString) + static_cast<const ObjString&>(object).chars.capacity();
+      case ObjType::Native:
+        return sizeof(ObjNative);
+      case ObjType::Function:
+        return sizeof(ObjFunction);
+    }
+
+    return sizeof(Obj);
+  }
+
+  Heap::~Heap() {
+    while (objects_) {
+      const auto next = objects_->next;
+      delete objects_;
+      objects_ = next;
+    }
+  }
+
+  ObjString* Heap::makeString(std::string&& chars) {
+    const auto string = new ObjString { std::move(chars), false };
+    track(string, sizeOf(*string));
+    return string;
+  }
+
+  void Heap::mark(const Value& value) noexcept {
+    if (const auto string = std::get_if<ObjString*>(&value); string && !(*string)->isConstant) {
+      (*string)->isMarked = true;
+    }
+  }
+
+  void Heap::track(Obj* object, size_t size) {
+    object->next = objects_;
+    objects_ = object;
+
+    stats_.bytesAllocated += size;
+    stats_.liveBytes += size;
+    stats_.peakBytes = std::max(stats_.peakBytes, stats_.liveBytes);
+    stats_.objectCount++;
+  }
+
+  void Heap::sweep() {
+    auto link = &objects_;
+    while (*link) {
+      const auto object = *link;
+      if (object->isMarked) {
+        object->isMarked = false;
+        link = &object->next;
+        continue;
+      }
+
+      *link = object->next;
+      const auto size = sizeOf(*object);
+      stats_.bytesFreed += size;
+      stats_.liveBytes -= size;
+      stats_.objectCount--;
+      delete object;
+    }
+
+    nextCollection_ = std::max(initialThreshold_, static_cast<size_t>(static_cast<double>(stats_.liveBytes) * growthFactor_));
+  }
+
+  void Heap::recordPause(std::chrono::nanoseconds pause) {
+    stats_.collectionCount++;
+    stats_.totalPause += pause;
+    stats_.maxPause = std::max(stats_.maxPause, pause);
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "object.h"
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace Lox {
+  struct HeapStats {
+    size_t bytesAllocated { 0 };
+    size_t bytesFreed { 0 };
+    size_t peakBytes { 0 };
+    size_t liveBytes { 0 };
+    size_t objectCount { 0 };
+    size_t collectionCount { 0 };
+    std::chrono::nanoseconds totalPause { 0 };
+    std::chrono::nanoseconds maxPause { 0 };
+  };
+
+  // Owns every object created at runtime and frees the unreachable ones with a stop-the-world mark-sweep.
+  class Heap {
+  public:
+    Heap(size_t initialThreshold, double growthFactor)
+      : initialThreshold_(initialThreshold), growthFactor_(growthFactor), nextCollection_(initialThreshold) {}
+
+    ~Heap();
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    ObjString* makeString(std::string&& chars);
+
+    constexpr bool shouldCollect() const noexcept { return stats_.liveBytes >= nextCollection_; }
+    constexpr const HeapStats& stats() const noexcept { return stats_; }
+
+    // markRoots must call mark for every value the program can still reach.
+    template<typename MarkRoots>
+    void collect(MarkRoots&& markRoots) {
+      const auto start = std::chrono::steady_clock::now();
+      markRoots();
+      sweep();
+      recordPause(std::chrono::steady_clock::now() - start);
+    }
+
+    void mark(const Value& value) noexcept;
+
+  private:
+    void track(Obj* object, size_t size);
+    void sweep();
+    void recordPause(std::chrono::nanoseconds pause);
+
+    const size_t initialThreshold_;
+    const double growthFactor_;
+    size_t nextCollection_;
+    Obj* objects_ { nullptr };
+    HeapStats stats_ {};
+  };
+}
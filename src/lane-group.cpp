@@ -0,0 +1,396 @@
+#include "lane-group.h"
+
+#include "chunk.h"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <utility>
+
+namespace Lox {
+  LaneGroup::LaneGroup(VM& vm, std::shared_ptr<const Chunk> chunk, std::vector<std::string> inputs, std::vector<std::string> outputs)
+    : vm_(vm), chunk_(std::move(chunk)), inputs_(std::move(inputs)), outputs_(std::move(outputs)) {
+    for (const auto& input : inputs_) inputGlobals_.push_back(&globals_[input]);
+  }
+
+  LaneGroup::Results LaneGroup::run(const std::vector<double>& inputs, size_t recordCount) {
+    Results results { std::vector<ResultStatus>(recordCount), std::vector<Value>(recordCount * outputs_.size()) };
+    for (size_t first = 0; first < recordCount; first += width) {
+      runLanes(
+        inputs.data() + first * inputs_.size(), std::min(width, recordCount - first),
+        results.statuses.data() + first, results.outputs.data() + first * outputs_.size());
+    }
+
+    return results;
+  }
+
+  void LaneGroup::runLanes(const double* inputs, size_t count, ResultStatus* statuses, Value* outputs) {
+    const auto allLanes = static_cast<Mask>((1u << count) - 1);
+
+    for (auto& global : globals_) global.second.definedLanes = 0;
+    for (size_t i = 0; i < inputs_.size(); ++i) {
+      auto& global = *inputGlobals_[i];
+      global.definedLanes = allLanes;
+      for (size_t lane = 0; lane < count; ++lane) {
+        global.slot.numbers[lane] = inputs[lane * inputs_.size() + i];
+        global.slot.types[lane] = Type::Number;
+      }
+    }
+
+    // Always advancing the path furthest behind lets paths that split at a forward jump meet again where they rejoin.
+    scalarLanes_ = chunk_->isVerified() ? 0 : allLanes;
+    if (scalarLanes_ == 0) paths_.push_back({ 0, 0, allLanes, takeStack() });
+    while (!paths_.empty()) {
+      const auto behind = std::min_element(paths_.begin(), paths_.end(), [](const auto& left, const auto& right) {
+        return left.offset < right.offset;
+      });
+      auto path = std::move(*behind);
+      paths_.erase(behind);
+
+      auto horizon = std::numeric_limits<size_t>::max();
+      for (const auto& other : paths_) horizon = std::min(horizon, other.offset);
+
+      runPath(path, horizon);
+      addPath(std::move(path));
+    }
+
+    for (size_t i = 0; i < outputs_.size(); ++i) {
+      const auto global = globals_.find(outputs_[i]);
+      for (size_t lane = 0; lane < count; ++lane) {
+        if (scalarLanes_ >> lane & 1 || global == globals_.cend() || !(global->second.definedLanes >> lane & 1)) continue;
+
+        const auto& slot = global->second.slot;
+        auto& output = outputs[lane * outputs_.size() + i];
+        if (slot.types[lane] == Type::Number) {
+          output = slot.numbers[lane];
+        } else if (slot.types[lane] == Type::Bool) {
+          output = slot.numbers[lane] != 0;
+        }
+      }
+    }
+
+    for (size_t lane = 0; lane < count; ++lane) {
+      const auto isScalar = scalarLanes_ >> lane & 1;
+      statuses[lane] = isScalar ? runScalar(inputs + lane * inputs_.size(), outputs + lane * outputs_.size()) : ResultStatus::OK;
+    }
+  }
+
+  ResultStatus LaneGroup::runScalar(const double* inputs, Value* outputs) {
+    scalarLaneCount_++;
+
+    vm_.reset();
+    for (size_t i = 0; i < inputs_.size(); ++i) vm_.setGlobal(inputs_[i], inputs[i]);
+    const auto status = vm_.run(chunk_);
+
+    for (size_t i = 0; i < outputs_.size(); ++i) {
+      const auto value = vm_.getGlobal(outputs_[i]);
+      if (value && !std::holds_alternative<ObjString*>(*value)) outputs[i] = *value;
+    }
+
+    return status;
+  }
+
+  // Paths that reach the same offset have the same depth, so the newcomer's lanes are blended into the other's stack.
+  void LaneGroup::addPath(Path&& path) {
+    const auto same = std::find_if(paths_.begin(), paths_.end(), [&](const auto& other) { return other.offset == path.offset; });
+    if (path.lanes != 0 && same == paths_.end()) {
+      paths_.push_back(std::move(path));
+      return;
+    }
+
+    if (path.lanes != 0) {
+      for (size_t row = 0; row < path.depth; ++row) {
+        auto& target = same->stack[row];
+        const auto& source = path.stack[row];
+        for (size_t lane = 0; lane < width; ++lane) {
+          if (!(path.lanes >> lane & 1)) continue;
+
+          target.numbers[lane] = source.numbers[lane];
+          target.types[lane] = source.types[lane];
+          target.strings[lane] = source.strings[lane];
+        }
+      }
+
+      same->lanes |= path.lanes;
+    }
+
+    spareStacks_.push_back(std::move(path.stack));
+  }
+
+  std::vector<LaneGroup::Slot> LaneGroup::takeStack() {
+    if (spareStacks_.empty()) return std::vector<Slot>(chunk_->maxStackDepth());
+
+    auto stack = std::move(spareStacks_.back());
+    spareStacks_.pop_back();
+    return stack;
+  }
+
+  // Names are chunk constants, so each one is hashed by content only once.
+  LaneGroup::Global* LaneGroup::findGlobal(const ObjString* name) {
+    const auto cached = globalsByName_.find(name);
+    if (cached != globalsByName_.end()) return cached->second;
+
+    const auto global = globals_.find(name->chars);
+    if (global == globals_.end()) return nullptr;
+
+    return globalsByName_[name] = &global->second;
+  }
+
+  // Runs the path's lanes until it passes the horizon, where the next path waits, or until a Return, after which
+  // the path has no lanes left. Lanes that cannot continue here are handed to the VM.
+  void LaneGroup::runPath(Path& path, size_t horizon) {
+    const auto& chunk = *chunk_;
+    auto& stack = path.stack;
+    while (path.lanes != 0 && path.offset < horizon) {
+      const auto opCode = static_cast<OpCode>(chunk.read(path.offset));
+      const auto operand = hasOperand(opCode) ? static_cast<size_t>(chunk.read(path.offset + 1)) : 0;
+      const auto next = path.offset + (hasOperand(opCode) ? 2 : 1);
+      const auto depth = path.depth;
+      const auto effect = stackEffect(opCode, operand);
+      path.depth = depth - effect.pops + effect.pushes;
+      path.offset = next;
+
+      const auto failWhere = [&](auto isFailing) {
+        Mask failed = 0;
+        for (size_t lane = 0; lane < width; ++lane) {
+          if (path.lanes >> lane & 1 && isFailing(lane)) failed |= static_cast<Mask>(1) << lane;
+        }
+
+        fail(failed);
+        path.lanes &= ~failed;
+      };
+
+      // Lanes outside the path hold leftovers, so a lane is only examined when some lane is not a number.
+      const auto failNonNumbers = [&](const Slot& slot) {
+        auto isUniform = true;
+        for (size_t lane = 0; lane < width; ++lane) isUniform &= slot.types[lane] == Type::Number;
+        if (!isUniform) failWhere([&](size_t lane) { return slot.types[lane] != Type::Number; });
+      };
+
+      const auto failStrings = [&](const Slot& slot) {
+        auto hasString = false;
+        for (size_t lane = 0; lane < width; ++lane) hasString |= slot.types[lane] == Type::String;
+        if (hasString) failWhere([&](size_t lane) { return slot.types[lane] == Type::String; });
+      };
+
+      const auto assign = [](Slot& target, const Value& value) {
+        const auto number = std::get_if<double>(&value);
+        const auto boolean = std::get_if<bool>(&value);
+        const auto string = std::get_if<ObjString*>(&value);
+        target.numbers.fill(number ? *number : boolean ? *boolean : 0);
+        target.types.fill(number ? Type::Number : boolean ? Type::Bool : string ? Type::String : Type::Nil);
+        target.strings.fill(string ? *string : nullptr);
+      };
+
+      const auto setBools = [](Slot& target, const std::array<bool, width>& results) {
+        for (size_t lane = 0; lane < width; ++lane) target.numbers[lane] = results[lane];
+        target.types.fill(Type::Bool);
+      };
+
+      const auto isTruthy = [](const Slot& slot, size_t lane) {
+        return slot.types[lane] == Type::Bool ? slot.numbers[lane] != 0 : slot.types[lane] != Type::Nil;
+      };
+
+      const auto calculate = [&](auto operation) {
+        auto& left = stack[depth - 2];
+        const auto& right = stack[depth - 1];
+        for (size_t lane = 0; lane < width; ++lane) left.numbers[lane] = operation(left.numbers[lane], right.numbers[lane]);
+      };
+
+      const auto compare = [&](auto comparison) {
+        const auto& left = stack[depth - 2];
+        const auto& right = stack[depth - 1];
+        std::array<bool, width> results;
+        for (size_t lane = 0; lane < width; ++lane) results[lane] = comparison(left.numbers[lane], right.numbers[lane]);
+        setBools(stack[depth - 2], results);
+      };
+
+      const auto calculateNumbers = [&](auto operation) {
+        failNonNumbers(stack[depth - 2]);
+        failNonNumbers(stack[depth - 1]);
+        calculate(operation);
+      };
+
+      const auto compareNumbers = [&](auto comparison) {
+        failNonNumbers(stack[depth - 2]);
+        failNonNumbers(stack[depth - 1]);
+        compare(comparison);
+      };
+
+      // Names come from constants; a global is looked up once for each distinct name among the lanes.
+      const auto forGlobal = [&](const Slot& names, auto visit) {
+        const ObjString* name = nullptr;
+        Global* global = nullptr;
+        failWhere([&](size_t lane) {
+          if (names.types[lane] != Type::String) return true;
+          if (names.strings[lane] != name) {
+            name = names.strings[lane];
+            global = findGlobal(name);
+          }
+
+          return !visit(global, lane);
+        });
+      };
+
+      switch (opCode) {
+        case OpCode::Constant: {
+          const auto& constant = chunk.getConstant(operand);
+          assign(stack[depth], constant);
+          // Slots have no function type; a function is only of use to a call, which is left to the VM anyway.
+          if (std::holds_alternative<ObjFunction*>(constant)) failWhere([](size_t) { return true; });
+        } break;
+        case OpCode::Nil:
+          assign(stack[depth], Value {});
+          break;
+        case OpCode::True:
+          assign(stack[depth], true);
+          break;
+        case OpCode::False:
+          assign(stack[depth], false);
+          break;
+        case OpCode::Pop:
+          break;
+        case OpCode::DefineGlobal: {
+          const auto& value = stack[depth - 1];
+          forGlobal(stack[depth - 2], [&](Global*& global, size_t lane) {
+            if (value.types[lane] == Type::String) return false;
+            if (!global) global = &globals_[stack[depth - 2].strings[lane]->chars];
+            if (global->definedLanes >> lane & 1) return false;
+
+            global->slot.numbers[lane] = value.numbers[lane];
+            global->slot.types[lane] = value.types[lane];
+            global->definedLanes |= static_cast<Mask>(1) << lane;
+            return true;
+          });
+        } break;
+        case OpCode::SetGlobal: {
+          const auto& value = stack[depth - 1];
+          forGlobal(stack[depth - 2], [&](Global* global, size_t lane) {
+            if (!global || !(global->definedLanes >> lane & 1) || value.types[lane] == Type::String) return false;
+
+            global->slot.numbers[lane] = value.numbers[lane];
+            global->slot.types[lane] = value.types[lane];
+            return true;
+          });
+          stack[depth - 2] = value;
+        } break;
+        case OpCode::GetGlobal: {
+          auto& slot = stack[depth - 1];
+          forGlobal(slot, [&](Global* global, size_t lane) {
+            if (!global || !(global->definedLanes >> lane & 1)) return false;
+
+            slot.numbers[lane] = global->slot.numbers[lane];
+            slot.types[lane] = global->slot.types[lane];
+            return true;
+          });
+        } break;
+        case OpCode::SetLocal:
+          stack[operand] = stack[depth - 1];
+          break;
+        case OpCode::GetLocal:
+          stack[depth] = stack[operand];
+          break;
+        case OpCode::Equal:
+        case OpCode::NotEqual: {
+          const auto& left = stack[depth - 2];
+          const auto& right = stack[depth - 1];
+          failStrings(left);
+          failStrings(right);
+
+          const auto isEqual = opCode == OpCode::Equal;
+          std::array<bool, width> results;
+          for (size_t lane = 0; lane < width; ++lane) {
+            const auto isSame = left.types[lane] == right.types[lane] &&
+              (left.types[lane] == Type::Nil || left.numbers[lane] == right.numbers[lane]);
+            results[lane] = isSame == isEqual;
+          }
+          setBools(stack[depth - 2], results);
+        } break;
+        case OpCode::Greater:
+          compareNumbers(std::greater<> {});
+          break;
+        case OpCode::GreaterEqual:
+          compareNumbers(std::greater_equal<> {});
+          break;
+        case OpCode::Less:
+          compareNumbers(std::less<> {});
+          break;
+        case OpCode::LessEqual:
+          compareNumbers(std::less_equal<> {});
+          break;
+        case OpCode::Add:
+          calculateNumbers(std::plus<> {});
+          break;
+        case OpCode::Subtract:
+          calculateNumbers(std::minus<> {});
+          break;
+        case OpCode::Multiply:
+          calculateNumbers(std::multiplies<> {});
+          break;
+        case OpCode::Divide: {
+          const auto& right = stack[depth - 1];
+          auto hasZero = false;
+          for (size_t lane = 0; lane < width; ++lane) hasZero |= right.numbers[lane] == 0;
+          if (hasZero) failWhere([&](size_t lane) { return right.types[lane] == Type::Number && right.numbers[lane] == 0; });
+          calculateNumbers(std::divides<> {});
+        } break;
+        case OpCode::AddNumber:
+          calculate(std::plus<> {});
+          break;
+        case OpCode::LessNumber:
+          compare(std::less<> {});
+          break;
+        case OpCode::Negative:
+        case OpCode::NegateNumber: {
+          auto& slot = stack[depth - 1];
+          if (opCode == OpCode::Negative) failNonNumbers(slot);
+          for (size_t lane = 0; lane < width; ++lane) slot.numbers[lane] = -slot.numbers[lane];
+        } break;
+        case OpCode::Not: {
+          auto& slot = stack[depth - 1];
+          std::array<bool, width> results;
+          for (size_t lane = 0; lane < width; ++lane) results[lane] = !isTruthy(slot, lane);
+          setBools(slot, results);
+        } break;
+        case OpCode::Print:
+        case OpCode::Call:
+          // Output has to appear record by record and natives run on a VM, so these lanes are left to the VM.
+          failWhere([](size_t) { return true; });
+          break;
+        case OpCode::Jump:
+          path.offset = next + operand;
+          break;
+        case OpCode::Loop:
+          path.offset = next - operand;
+          break;
+        case OpCode::JumpIfTrue:
+        case OpCode::JumpIfFalse:
+        case OpCode::PopJumpIfTrue:
+        case OpCode::PopJumpIfFalse:
+        case OpCode::PopLoopIfTrue: {
+          const auto& condition = stack[depth - 1];
+          const auto target = branchTarget(opCode, next, operand);
+          const auto jumpsIfTruthy = opCode != OpCode::JumpIfFalse && opCode != OpCode::PopJumpIfFalse;
+          Mask taken = 0;
+          for (size_t lane = 0; lane < width; ++lane) {
+            taken |= static_cast<Mask>(isTruthy(condition, lane) == jumpsIfTruthy) << lane;
+          }
+          taken &= path.lanes;
+
+          if (taken == path.lanes) {
+            path.offset = target;
+          } else if (taken != 0) {
+            auto branch = takeStack();
+            std::copy(stack.begin(), stack.begin() + static_cast<std::ptrdiff_t>(path.depth), branch.begin());
+            addPath({ target, path.depth, taken, std::move(branch) });
+            horizon = std::min(horizon, target);
+            path.lanes &= ~taken;
+          }
+        } break;
+        case OpCode::ReturnValue:
+        case OpCode::Return:
+          path.lanes = 0;
+          break;
+      }
+    }
+  }
+}
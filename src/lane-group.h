@@ -0,0 +1,92 @@
+#pragma once
+
+#include "vm.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace Lox {
+  class Chunk;
+
+  // Runs one chunk over many records, `width` records at a time in lockstep. Every stack slot and global holds
+  // one value per record (lane), stored structure-of-arrays, and lanes that disagree at a conditional jump are
+  // masked off until the paths meet again. A lane that needs a string, prints or fails is rerun on its own in the VM,
+  // so each record behaves as if it had been run by VM::reset, VM::setGlobal and VM::run.
+  class LaneGroup {
+  public:
+    static constexpr size_t width = 8;
+
+    // Outputs are stored record by record, one value per output name.
+    struct Results {
+      std::vector<ResultStatus> statuses;
+      std::vector<Value> outputs;
+    };
+
+    LaneGroup(VM& vm, std::shared_ptr<const Chunk> chunk, std::vector<std::string> inputs, std::vector<std::string> outputs);
+    LaneGroup(const LaneGroup&) = delete;
+    LaneGroup& operator=(const LaneGroup&) = delete;
+
+    // Inputs are stored record by record, one number per input name. An output is nil if it is undefined or a string,
+    // since strings do not outlive the VM run that made them.
+    Results run(const std::vector<double>& inputs, size_t recordCount);
+
+    constexpr size_t scalarLaneCount() const noexcept { return scalarLaneCount_; }
+
+  private:
+    using Mask = std::uint32_t;
+
+    enum class Type : unsigned char {
+      Nil,
+      Bool,
+      Number,
+      String
+    };
+
+    // Bools are stored as 0 or 1 in numbers; strings only ever come from constants.
+    struct Slot {
+      std::array<double, width> numbers;
+      std::array<Type, width> types;
+      std::array<const ObjString*, width> strings;
+    };
+
+    struct Global {
+      Slot slot;
+      Mask definedLanes;
+    };
+
+    // Each path has a stack of its own, so instructions compute every lane and only merging paths blends them.
+    struct Path {
+      size_t offset;
+      size_t depth;
+      Mask lanes;
+      std::vector<Slot> stack;
+    };
+
+    void runLanes(const double* inputs, size_t count, ResultStatus* statuses, Value* outputs);
+    ResultStatus runScalar(const double* inputs, Value* outputs);
+    void runPath(Path& path, size_t horizon);
+    void addPath(Path&& path);
+    std::vector<Slot> takeStack();
+
+    Global* findGlobal(const ObjString* name);
+    void fail(Mask lanes) noexcept { scalarLanes_ |= lanes; }
+
+    VM& vm_;
+    const std::shared_ptr<const Chunk> chunk_;
+    const std::vector<std::string> inputs_;
+    const std::vector<std::string> outputs_;
+
+    std::unordered_map<std::string_view, Global> globals_ {};
+    std::vector<Global*> inputGlobals_ {};
+    std::unordered_map<const ObjString*, Global*> globalsByName_ {};
+    std::vector<Path> paths_ {};
+    std::vector<std::vector<Slot>> spareStacks_ {};
+    Mask scalarLanes_ { 0 };
+    size_t scalarLaneCount_ { 0 };
+  };
+}
@@ -0,0 +1,49 @@
+#include "linker.h"
+
+#include "verifier.h"
+#include <limits>
+#include <string>
+
+namespace Lox {
+  static constexpr auto maxConstants = static_cast<size_t>(std::numeric_limits<unsigned char>::max()) + 1;
+
+  void Linker::add(const Chunk& module) {
+    if (current_->constantCount() + module.constantCount() > maxConstants) finishChunk();
+
+    std::vector<std::byte> constantMap(module.constantCount());
+    for (size_t i = 0; i < module.constantCount(); ++i) {
+      constantMap[i] = static_cast<std::byte>(current_->copyConstant(module.getConstant(i)));
+    }
+
+    // Every module ends in a single Return; dropping it lets control fall through into the next module.
+    for (size_t offset = 0; offset < module.size();) {
+      const auto opCode = static_cast<OpCode>(module.read(offset));
+      if (opCode == OpCode::Return) {
+        endPosition_ = module.getPosition(offset);
+        offset++;
+        continue;
+      }
+
+      current_->write(opCode, module.getPosition(offset));
+      if (hasOperand(opCode)) {
+        const auto operand = module.read(offset + 1);
+        current_->write(opCode == OpCode::Constant ? constantMap[static_cast<size_t>(operand)] : operand);
+      }
+
+      offset += hasOperand(opCode) ? 2 : 1;
+    }
+  }
+
+  std::vector<std::shared_ptr<const Chunk>> Linker::finish() {
+    finishChunk();
+    return std::move(chunks_);
+  }
+
+  void Linker::finishChunk() {
+    current_->write(OpCode::Return, endPosition_);
+    current_->trackStackDepth(0);
+    current_->setVerified(!findVerificationProblem(*current_));
+    chunks_.push_back(std::move(current_));
+    current_ = std::make_unique<Chunk>();
+  }
+}
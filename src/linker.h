@@ -0,0 +1,24 @@
+#pragma once
+
+#include "chunk.h"
+#include <memory>
+#include <vector>
+
+namespace Lox {
+  // Concatenates separately compiled modules into as few chunks as the one-byte constant operand allows.
+  // Jumps are relative to the instruction, so module code needs no relocation beyond its constant indices.
+  class Linker {
+  public:
+    void add(const Chunk& module);
+
+    // The resulting chunks make up one program and are meant to be run in order on the same VM.
+    std::vector<std::shared_ptr<const Chunk>> finish();
+
+  private:
+    void finishChunk();
+
+    std::vector<std::shared_ptr<const Chunk>> chunks_ {};
+    std::unique_ptr<Chunk> current_ { std::make_unique<Chunk>() };
+    std::pair<unsigned, unsigned> endPosition_ { 1, 1 };
+  };
+}
@@ -0,0 +1,49 @@
+#include "local-table.h"
+
+namespace Lox {
+  void LocalTable::declare(std::string_view name, unsigned depth) {
+    const auto [innermost, isNew] = innermost_.try_emplace(name, locals_.size());
+    locals_.push_back({ name, depth, isNew ? std::nullopt : std::optional<size_t> { innermost->second } });
+    innermost->second = locals_.size() - 1;
+  }
+
+  std::optional<size_t> LocalTable::resolve(std::string_view name) const {
+    const auto innermost = innermost_.find(name);
+    if (innermost == innermost_.cend()) return std::nullopt;
+
+    return innermost->second;
+  }
+
+  bool LocalTable::isDeclaredAt(std::string_view name, unsigned depth) const {
+    const auto slot = resolve(name);
+    return slot && locals_[*slot].depth == depth;
+  }
+
+  size_t LocalTable::countDeeperThan(unsigned depth) const {
+    size_t count = 0;
+    for (auto it = locals_.crbegin(); it != locals_.crend() && it->depth > depth; ++it) count++;
+
+    return count;
+  }
+
+  size_t LocalTable::popScopesDeeperThan(unsigned depth) {
+    const auto count = countDeeperThan(depth);
+    for (auto i = count; i > 0; --i) {
+      const auto& local = locals_.back();
+      if (local.shadowed) {
+        innermost_[local.name] = *local.shadowed;
+      } else {
+        innermost_.erase(local.name);
+      }
+
+      locals_.pop_back();
+    }
+
+    return count;
+  }
+
+  void LocalTable::clear() {
+    locals_.clear();
+    innermost_.clear();
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace Lox {
+  // The compiler's locals in stack slot order. A hash index maps each name to its innermost declaration, and each
+  // declaration remembers the one it shadows, so lookups and scope exits cost the same however many locals there are.
+  class LocalTable {
+  public:
+    size_t size() const noexcept { return locals_.size(); }
+
+    void declare(std::string_view name, unsigned depth);
+    std::optional<size_t> resolve(std::string_view name) const;
+    bool isDeclaredAt(std::string_view name, unsigned depth) const;
+
+    // Counts the locals from scopes deeper than depth; popScopesDeeperThan also removes them.
+    size_t countDeeperThan(unsigned depth) const;
+    size_t popScopesDeeperThan(unsigned depth);
+
+    void clear();
+
+  private:
+    struct Local {
+      std::string_view name;
+      unsigned depth;
+      std::optional<size_t> shadowed;
+    };
+
+    std::vector<Local> locals_ {};
+    std::unordered_map<std::string_view, size_t> innermost_ {};
+  };
+}
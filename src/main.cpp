@@ -1,7 +1,24 @@
+#include "c-emitter.h"
+#include "linker.h"
+#include "metrics.h"
+#include "module-cache.h"
+#include "profiler.h"
+#include "thread-pool.h"
 #include "vm.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 using namespace Lox;
 
@@ -13,25 +30,104 @@ namespace {
   constexpr auto dynamicErrorCode = 70;
   constexpr auto ioErrorCode = 74;
 
-  VM vm {};
+  constexpr auto usage =
+    "Usage: cclox [-O] [--gc-stats] [--exact-numbers] [--profile <output>] [--metrics=<output>] [<snapshot options>] [<path>]\n"
+    "       cclox [--gc-stats] [--profile <output>] [--metrics=<output>] [<snapshot options>] --stream <path>\n"
+    "       cclox [-O] [--gc-stats] [--profile <output>] [--metrics=<output>] [<snapshot options>] [--cache <directory>] <path>...\n"
+    "       cclox [-O] [--metrics=<output>] [--jobs <n>] [--manifest <path>] [<path>...]\n"
+    "       cclox [-O] [--exact-numbers] --emit-c <output> <path>\n"
+    "Snapshot options: --load-snapshot <path> --save-snapshot <output>\n";
+
+  VMOptions options {};
+  auto shouldStream = false;
+  auto shouldReportGc = false;
+  auto shouldRecordMetrics = false;
+  MetricsReport metricsReport {};
+  std::optional<ModuleCache> cache {};
+  std::optional<std::string> snapshotInput {};
+  std::optional<std::string> snapshotOutput {};
 }
 
-int run(const std::string& source, unsigned line = 1) {
-  const auto status = vm.interpret(source, line);
+int exitCode(ResultStatus status) {
   return
     status == ResultStatus::StaticError ? staticErrorCode :
     status == ResultStatus::DynamicError ? dynamicErrorCode : successCode;
 }
 
-int runFile(const char* path) {
+std::optional<std::string> readFile(const std::string& path) {
   std::ifstream input { path };
-  if (!input) {
+  if (!input) return std::nullopt;
+
+  return std::string { std::istreambuf_iterator<char> { input }, {} };
+}
+
+void reportGc(const VM& vm) {
+  if (!shouldReportGc) return;
+
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  const auto& stats = vm.heapStats();
+  std::cerr
+    << "gc: " << stats.collectionCount << " collections, "
+    << Milliseconds { stats.totalPause }.count() << " ms total pause, "
+    << Milliseconds { stats.maxPause }.count() << " ms max pause\n"
+    << "heap: " << stats.bytesAllocated << " bytes allocated, " << stats.bytesFreed << " freed, "
+    << stats.peakBytes << " peak, " << stats.liveBytes << " live in " << stats.objectCount << " objects\n";
+}
+
+template<typename Write>
+bool writeFile(const std::string& path, Write&& write) {
+  std::ofstream output { path };
+  write(output);
+  if (output) return true;
+
+  std::cerr << "Could not write file: " << path << '\n';
+  return false;
+}
+
+void recordMetrics(const std::string& script, const Metrics& metrics) {
+  if (shouldRecordMetrics) metricsReport.emplace_back(script, metrics);
+}
+
+bool loadSnapshot(VM& vm) {
+  if (!snapshotInput) return true;
+
+  std::ifstream input { *snapshotInput, std::ios::binary };
+  if (input && vm.readSnapshot(input)) return true;
+
+  std::cerr << "Could not read snapshot: " << *snapshotInput << '\n';
+  return false;
+}
+
+bool saveSnapshot(const VM& vm) {
+  if (!snapshotOutput) return true;
+
+  std::ofstream output { *snapshotOutput, std::ios::binary };
+  vm.writeSnapshot(output);
+  if (output) return true;
+
+  std::cerr << "Could not write file: " << *snapshotOutput << '\n';
+  return false;
+}
+
+// Saves the globals only after a clean run, so a failed prelude never becomes a snapshot.
+int finishRun(const VM& vm, int code) {
+  return code == successCode && !saveSnapshot(vm) ? ioErrorCode : code;
+}
+
+int runFile(const std::string& path) {
+  const auto source = readFile(path);
+  if (!source) {
     std::cerr << "Could not open file: " << path << '\n';
     return ioErrorCode;
   }
 
-  std::string source { std::istreambuf_iterator<char> { input }, {} };
-  return run(source);
+  VM vm { options };
+  if (!loadSnapshot(vm)) return ioErrorCode;
+
+  const auto code = exitCode(shouldStream ? vm.interpretStreaming(*source, 1) : vm.interpret(*source, 1));
+  reportGc(vm);
+  recordMetrics(path, vm.metrics());
+  return finishRun(vm, code);
 }
 
 int runPrompt() {
@@ -40,19 +136,316 @@ int runPrompt() {
     << "* Statements may not include line breaks.\n"
     << "* Standalone expressions are not allowed.\n\n";
 
+  VM vm { options };
+  if (!loadSnapshot(vm)) return ioErrorCode;
+
   std::string source;
   for (auto line = 1u; ; ++line) {
     std::cout << "cclox:" << line << "> ";
-    std::getline(std::cin, source);
-    run(source, line);
+    if (!std::getline(std::cin, source)) {
+      reportGc(vm);
+      recordMetrics("<repl>", vm.metrics());
+      return finishRun(vm, successCode);
+    }
+
+    vm.interpretIncrementally(source, line);
+  }
+}
+
+// Each worker reuses one VM, reset between scripts; captured output is replayed in the order given.
+int runBatch(const std::vector<std::string>& paths, unsigned jobs) {
+  struct Result {
+    std::string output;
+    std::string errorOutput;
+    int code;
+    Metrics metrics;
+  };
+
+  struct Worker {
+    std::ostringstream output {};
+    std::ostringstream errorOutput {};
+    std::unique_ptr<VM> vm { std::make_unique<VM>(options, output, errorOutput) };
+  };
+
+  // A worker beyond one per script would only hold an idle VM.
+  ThreadPool pool { static_cast<unsigned>(std::min<size_t>(jobs, paths.size())) };
+  std::vector<Worker> workers(pool.workerCount());
+  std::vector<Result> results(paths.size());
+  std::vector<ThreadPool::Task> tasks {};
+  for (size_t i = 0; i < paths.size(); ++i) {
+    tasks.emplace_back([&workers, &path = paths[i], &result = results[i]](unsigned index) {
+      auto& worker = workers[index];
+      auto code = successCode;
+      Metrics metrics {};
+
+      const auto source = readFile(path);
+      if (!source) {
+        worker.errorOutput << "Could not open file: " << path << '\n';
+        code = ioErrorCode;
+      } else {
+        try {
+          worker.vm->reset();
+          worker.vm->resetMetrics();
+          code = exitCode(worker.vm->interpret(*source, 1));
+          metrics = worker.vm->metrics();
+        } catch (const std::exception& exception) {
+          worker.errorOutput << path << ": " << exception.what() << '\n';
+          worker.vm = std::make_unique<VM>(options, worker.output, worker.errorOutput);
+          code = dynamicErrorCode;
+        }
+      }
+
+      result = { worker.output.str(), worker.errorOutput.str(), code, metrics };
+      worker.output.str({});
+      worker.errorOutput.str({});
+    });
+  }
+
+  pool.run(std::move(tasks));
+
+  auto worstCode = successCode;
+  auto failureCount = 0u;
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& result = results[i];
+    std::cout << result.output;
+    std::cerr << result.errorOutput;
+    if (result.code != successCode) failureCount++;
+
+    recordMetrics(paths[i], result.metrics);
+    worstCode = std::max(worstCode, result.code);
+  }
+
+  if (failureCount > 0) std::cerr << failureCount << " of " << results.size() << " scripts failed.\n";
+
+  return worstCode;
+}
+
+// Compiles every file in parallel (or loads it from the cache), then links them into one program sharing globals.
+int runProgram(const std::vector<std::string>& paths) {
+  struct Module {
+    std::shared_ptr<const Chunk> chunk;
+    std::string errorOutput;
+    int code;
+    CompileMetrics metrics;
+  };
+
+  std::vector<Module> modules(paths.size());
+  std::vector<ThreadPool::Task> tasks {};
+  for (size_t i = 0; i < paths.size(); ++i) {
+    tasks.emplace_back([&path = paths[i], &module = modules[i]](unsigned) {
+      const auto source = readFile(path);
+      if (!source) {
+        module = { nullptr, "Could not open file: " + path + '\n', ioErrorCode, {} };
+        return;
+      }
+
+      if (cache) {
+        if (auto chunk = cache->load(*source)) {
+          module = { std::move(chunk), {}, successCode, {} };
+          return;
+        }
+      }
+
+      std::ostringstream errorOutput {};
+      ErrorReporter errorReporter { errorOutput };
+      try {
+        Compiler compiler { errorReporter, options.shouldOptimize };
+        auto chunk = compiler.compile(*source, 1);
+        if (errorReporter.errorCount() > 0) {
+          errorReporter.displayErrorCount();
+          module = { nullptr, path + ":\n" + errorOutput.str(), staticErrorCode, compiler.metrics() };
+          return;
+        }
+
+        if (cache) cache->store(*source, *chunk);
+        module = { std::move(chunk), {}, successCode, compiler.metrics() };
+      } catch (const std::exception& exception) {
+        module = { nullptr, path + ": " + exception.what() + '\n', staticErrorCode, {} };
+      }
+    });
+  }
+
+  ThreadPool { std::thread::hardware_concurrency() }.run(std::move(tasks));
+
+  auto worstCode = successCode;
+  for (const auto& module : modules) {
+    std::cerr << module.errorOutput;
+    worstCode = std::max(worstCode, module.code);
+  }
+  if (worstCode != successCode) return worstCode;
+
+  Linker linker {};
+  for (const auto& module : modules) linker.add(*module.chunk);
+
+  VM vm { options };
+  if (!loadSnapshot(vm)) return ioErrorCode;
+
+  auto code = successCode;
+  for (auto& chunk : linker.finish()) {
+    code = exitCode(vm.run(std::move(chunk)));
+    if (code != successCode) break;
+  }
+
+  reportGc(vm);
+
+  // Modules were compiled outside the VM, so their compile metrics are added to the program's.
+  auto metrics = vm.metrics();
+  std::string script {};
+  for (size_t i = 0; i < paths.size(); ++i) {
+    metrics.compile.compileTime += modules[i].metrics.compileTime;
+    metrics.compile.bytecodeBytes += modules[i].metrics.bytecodeBytes;
+    metrics.compile.constantCount += modules[i].metrics.constantCount;
+    script += (i == 0 ? "" : " ") + paths[i];
   }
+  recordMetrics(script, metrics);
+
+  return finishRun(vm, code);
+}
+
+// Writes the compiled script as a C++ program instead of running it.
+int emitProgram(const std::string& path, const std::string& outputPath) {
+  const auto source = readFile(path);
+  if (!source) {
+    std::cerr << "Could not open file: " << path << '\n';
+    return ioErrorCode;
+  }
+
+  ErrorReporter errorReporter { std::cerr };
+  Compiler compiler { errorReporter, options.shouldOptimize };
+  const auto chunk = compiler.compile(*source, 1);
+  if (errorReporter.errorCount() > 0) {
+    errorReporter.displayErrorCount();
+    return staticErrorCode;
+  }
+
+  std::ostringstream program {};
+  try {
+    emitC(*chunk, program, options.isExactNumberOutput);
+  } catch (const std::invalid_argument& exception) {
+    std::cerr << "Could not translate " << path << " to C: " << exception.what() << '\n';
+    return staticErrorCode;
+  }
+
+  const auto isWritten = writeFile(outputPath, [&](std::ostream& output) { output << program.str(); });
+  return isWritten ? successCode : ioErrorCode;
 }
 
 int main(int argc, char** argv) {
-  if (argc > 2) {
-    std::cerr << "Usage: cclox [<path>]\n";
-    return usageErrorCode;
+  std::vector<std::string> paths {};
+  std::optional<unsigned> jobs {};
+  std::optional<std::string> manifest {};
+  std::optional<std::string> cacheDirectory {};
+  std::optional<std::string> profilePath {};
+  std::optional<std::string> metricsPath {};
+  std::optional<std::string> emitPath {};
+
+  for (auto i = 1; i < argc; ++i) {
+    const auto argument = std::string_view { argv[i] };
+    const auto hasValue = i + 1 < argc;
+    if (argument == "-O" || argument == "--optimize") {
+      options.shouldOptimize = true;
+    } else if (argument == "--stream") {
+      shouldStream = true;
+    } else if (argument == "--gc-stats") {
+      shouldReportGc = true;
+    } else if (argument == "--exact-numbers") {
+      options.isExactNumberOutput = true;
+    } else if (argument == "--jobs" && hasValue) {
+      const auto value = std::string_view { argv[++i] };
+      unsigned count = 0;
+      const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), count);
+      if (error != std::errc {} || end != value.data() + value.size() || count == 0) {
+        std::cerr << usage;
+        return usageErrorCode;
+      }
+
+      jobs = count;
+    } else if (argument == "--manifest" && hasValue) {
+      manifest = argv[++i];
+    } else if (argument == "--cache" && hasValue) {
+      cacheDirectory = argv[++i];
+    } else if (argument == "--profile" && hasValue) {
+      profilePath = argv[++i];
+    } else if (argument == "--load-snapshot" && hasValue) {
+      snapshotInput = argv[++i];
+    } else if (argument == "--save-snapshot" && hasValue) {
+      snapshotOutput = argv[++i];
+    } else if (argument == "--emit-c" && hasValue) {
+      emitPath = argv[++i];
+    } else if (argument.substr(0, 10) == "--metrics=") {
+      metricsPath = argument.substr(10);
+    } else if (argument.substr(0, 1) != "-") {
+      paths.emplace_back(argument);
+    } else {
+      std::cerr << usage;
+      return usageErrorCode;
+    }
+  }
+
+  if (manifest) {
+    std::ifstream input { *manifest };
+    if (!input) {
+      std::cerr << "Could not open file: " << *manifest << '\n';
+      return ioErrorCode;
+    }
+
+    for (std::string line; std::getline(input, line);) {
+      if (!line.empty() && line.front() != '#') paths.push_back(line);
+    }
+  }
+
+  if (emitPath) {
+    if (paths.size() != 1 || jobs || manifest || cacheDirectory || profilePath || metricsPath || shouldStream || snapshotInput || snapshotOutput) {
+      std::cerr << usage;
+      return usageErrorCode;
+    }
+
+    return emitProgram(paths.front(), *emitPath);
+  }
+
+  shouldRecordMetrics = metricsPath.has_value();
+
+  std::optional<Profiler> profiler {};
+  auto code = successCode;
+  if (jobs || manifest) {
+    // The profiler samples one thread at a time, so it cannot follow concurrent scripts,
+    // and each script starts from no globals at all.
+    if (profilePath || snapshotInput || snapshotOutput || shouldStream || cacheDirectory) {
+      std::cerr << usage;
+      return usageErrorCode;
+    }
+
+    code = runBatch(paths, jobs ? *jobs : std::thread::hardware_concurrency());
+  } else {
+    // Streaming runs one file as it is compiled, so it cannot be linked with others or loaded from the cache.
+    if (shouldStream && (paths.size() != 1 || cacheDirectory)) {
+      std::cerr << usage;
+      return usageErrorCode;
+    }
+
+    if (cacheDirectory && paths.empty()) {
+      std::cerr << usage;
+      return usageErrorCode;
+    }
+
+    if (profilePath) options.profiler = &profiler.emplace();
+    if (cacheDirectory) cache.emplace(*cacheDirectory, options.shouldOptimize);
+
+    code = paths.size() > 1 || cache ? runProgram(paths) : paths.empty() ? runPrompt() : runFile(paths.front());
+  }
+
+  if (profiler && !writeFile(*profilePath, [&](std::ostream& output) { profiler->write(output, "cclox"); })) {
+    return ioErrorCode;
+  }
+
+  // A .json path gets JSON; anything else gets the Prometheus text format.
+  if (metricsPath) {
+    const auto isJson = metricsPath->size() >= 5 && metricsPath->compare(metricsPath->size() - 5, 5, ".json") == 0;
+    const auto isWritten = writeFile(*metricsPath, [&](std::ostream& output) {
+      isJson ? writeJson(output, metricsReport) : writePrometheus(output, metricsReport);
+    });
+    if (!isWritten) return ioErrorCode;
   }
 
-  return argc == 2 ? runFile(argv[1]) : runPrompt();
+  return code;
 }
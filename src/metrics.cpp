@@ -0,0 +1,122 @@
+#include "metrics.h"
+
+#include <array>
+#include <cstdio>
+#include <ostream>
+#include <string_view>
+
+namespace {
+  using Seconds = std::chrono::duration<double>;
+
+  constexpr std::array<double, 8> bucketBounds = { 0.0001, 0.001, 0.01, 0.1, 0.5, 1, 5, 30 };
+
+  // Prometheus label values escape only backslashes, quotes and newlines.
+  std::string escapeLabel(std::string_view text) {
+    std::string escaped {};
+    for (const auto character : text) {
+      if (character == '"' || character == '\\' || character == '\n') escaped += '\\';
+      escaped += character == '\n' ? 'n' : character;
+    }
+    return escaped;
+  }
+
+  // JSON strings may not hold control characters at all; the common ones get their short escapes.
+  std::string escapeJson(std::string_view text) {
+    std::string escaped {};
+    for (const auto character : text) {
+      switch (character) {
+        case '"':
+        case '\\':
+          escaped.append(1, '\\').append(1, character);
+          break;
+        case '\n':
+          escaped += "\\n";
+          break;
+        case '\r':
+          escaped += "\\r";
+          break;
+        case '\t':
+          escaped += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(character) < 0x20) {
+            std::array<char, 7> code {};
+            std::snprintf(code.data(), code.size(), "\\u%04x", static_cast<unsigned>(character));
+            escaped += code.data();
+          } else {
+            escaped += character;
+          }
+      }
+    }
+    return escaped;
+  }
+
+  template<typename Field>
+  void writeSeries(std::ostream& output, const Lox::MetricsReport& report, const char* name, const char* type, const char* help, Field field) {
+    output << "# HELP cclox_" << name << ' ' << help << "\n# TYPE cclox_" << name << ' ' << type << '\n';
+    for (const auto& [script, metrics] : report) {
+      output << "cclox_" << name << "{script=\"" << escapeLabel(script) << "\"} " << field(metrics) << '\n';
+    }
+  }
+
+  template<typename Field>
+  void writeHistogram(std::ostream& output, const Lox::MetricsReport& report, const char* name, const char* help, Field field) {
+    output << "# HELP cclox_" << name << ' ' << help << "\n# TYPE cclox_" << name << " histogram\n";
+
+    auto sum = 0.0;
+    for (const auto& entry : report) sum += field(entry.second);
+
+    for (const auto bound : bucketBounds) {
+      size_t count = 0;
+      for (const auto& entry : report) count += field(entry.second) <= bound;
+
+      output << "cclox_" << name << "_bucket{le=\"" << bound << "\"} " << count << '\n';
+    }
+
+    output
+      << "cclox_" << name << "_bucket{le=\"+Inf\"} " << report.size() << '\n'
+      << "cclox_" << name << "_sum " << sum << '\n'
+      << "cclox_" << name << "_count " << report.size() << '\n';
+  }
+}
+
+namespace Lox {
+  void writeJson(std::ostream& output, const MetricsReport& report) {
+    output << "[\n";
+    for (size_t i = 0; i < report.size(); ++i) {
+      const auto& [script, metrics] = report[i];
+      output
+        << "  {\"script\": \"" << escapeJson(script) << "\""
+        << ", \"compileSeconds\": " << Seconds { metrics.compile.compileTime }.count()
+        << ", \"bytecodeBytes\": " << metrics.compile.bytecodeBytes
+        << ", \"constants\": " << metrics.compile.constantCount
+        << ", \"runSeconds\": " << Seconds { metrics.run.runTime }.count()
+        << ", \"instructions\": " << metrics.run.instructionCount
+        << ", \"peakStackDepth\": " << metrics.run.peakStackDepth
+        << ", \"globals\": " << metrics.run.globalCount
+        << ", \"stringBytesAllocated\": " << metrics.run.stringBytesAllocated
+        << (i + 1 < report.size() ? "},\n" : "}\n");
+    }
+    output << "]\n";
+  }
+
+  void writePrometheus(std::ostream& output, const MetricsReport& report) {
+    writeSeries(output, report, "bytecode_bytes", "gauge", "Bytes of bytecode compiled.",
+      [](const Metrics& metrics) { return metrics.compile.bytecodeBytes; });
+    writeSeries(output, report, "constants", "gauge", "Constant pool entries compiled.",
+      [](const Metrics& metrics) { return metrics.compile.constantCount; });
+    writeSeries(output, report, "instructions_total", "counter", "Bytecode instructions executed.",
+      [](const Metrics& metrics) { return metrics.run.instructionCount; });
+    writeSeries(output, report, "peak_stack_depth", "gauge", "Deepest value stack reached.",
+      [](const Metrics& metrics) { return metrics.run.peakStackDepth; });
+    writeSeries(output, report, "globals", "gauge", "Globals defined at the end of the run.",
+      [](const Metrics& metrics) { return metrics.run.globalCount; });
+    writeSeries(output, report, "string_bytes_allocated_total", "counter", "Bytes of strings allocated on the heap.",
+      [](const Metrics& metrics) { return metrics.run.stringBytesAllocated; });
+
+    writeHistogram(output, report, "compile_seconds", "Time spent compiling each script.",
+      [](const Metrics& metrics) { return Seconds { metrics.compile.compileTime }.count(); });
+    writeHistogram(output, report, "run_seconds", "Time spent running each script.",
+      [](const Metrics& metrics) { return Seconds { metrics.run.runTime }.count(); });
+  }
+}
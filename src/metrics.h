@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Lox {
+  struct CompileMetrics {
+    std::chrono::nanoseconds compileTime { 0 };
+    size_t bytecodeBytes { 0 };
+    size_t constantCount { 0 };
+  };
+
+  struct RunMetrics {
+    std::chrono::nanoseconds runTime { 0 };
+    size_t instructionCount { 0 };
+    size_t peakStackDepth { 0 };
+    size_t globalCount { 0 };
+    size_t stringBytesAllocated { 0 };
+  };
+
+  struct Metrics {
+    CompileMetrics compile;
+    RunMetrics run;
+  };
+
+  // Each entry is labelled with the script it was recorded for.
+  using MetricsReport = std::vector<std::pair<std::string, Metrics>>;
+
+  void writeJson(std::ostream& output, const MetricsReport& report);
+
+  // Per-script gauges and counters, plus histograms of compile and run time across all scripts.
+  void writePrometheus(std::ostream& output, const MetricsReport& report);
+}
@@ -0,0 +1,78 @@
+#include "module-cache.h"
+
+#include "binary-io.h"
+#include "chunk.h"
+#include "verifier.h"
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+namespace {
+  // 64-bit FNV-1a, which unlike std::hash is stable across builds and runs.
+  std::uint64_t hash(std::string_view bytes, std::uint64_t seed = 0xcbf29ce484222325) {
+    auto value = seed;
+    for (const auto byte : bytes) {
+      value ^= static_cast<unsigned char>(byte);
+      value *= 0x100000001b3;
+    }
+    return value;
+  }
+}
+
+namespace Lox {
+  ModuleCache::ModuleCache(std::string directory, bool isOptimized)
+    : directory_(std::move(directory)), isOptimized_(isOptimized) {
+    std::error_code error {};
+    std::filesystem::create_directories(directory_, error);
+  }
+
+  std::shared_ptr<const Chunk> ModuleCache::load(std::string_view source) const {
+    std::ifstream input { pathFor(source), std::ios::binary };
+    if (!input) return nullptr;
+
+    std::uint64_t length = 0;
+    if (!readRaw(input, length) || length != source.size()) return nullptr;
+
+    std::string storedSource(source.size(), '\0');
+    if (!input.read(storedSource.data(), static_cast<std::streamsize>(storedSource.size())) || storedSource != source) {
+      return nullptr;
+    }
+
+    // A cache file may be stale, truncated or tampered with, so its bytecode is verified before it is trusted.
+    auto chunk = Chunk::deserialize(input);
+    if (!chunk || findVerificationProblem(*chunk)) return nullptr;
+
+    chunk->setVerified(true);
+    return chunk;
+  }
+
+  // Writes go through a per-thread temporary file so concurrent stores of the same module never interleave.
+  void ModuleCache::store(std::string_view source, const Chunk& chunk) const {
+    const auto path = pathFor(source);
+    const auto temporaryPath = path + '.' + std::to_string(std::hash<std::thread::id> {}(std::this_thread::get_id()));
+    {
+      std::ofstream output { temporaryPath, std::ios::binary };
+      if (!output) return;
+
+      writeRaw(output, static_cast<std::uint64_t>(source.size()));
+      output.write(source.data(), static_cast<std::streamsize>(source.size()));
+      chunk.serialize(output);
+      if (!output) return;
+    }
+
+    std::error_code error {};
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error) std::filesystem::remove(temporaryPath, error);
+  }
+
+  std::string ModuleCache::pathFor(std::string_view source) const {
+    const auto key = hash(source, hash(isOptimized_ ? "cclox-O" : "cclox"));
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.loxc", static_cast<unsigned long long>(key));
+    return (std::filesystem::path { directory_ } / name).string();
+  }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace Lox {
+  class Chunk;
+
+  // Stores compiled chunks on disk keyed by a hash of their source, so unchanged files are not recompiled. Each entry
+  // also holds the source itself, so two sources that share a hash never load each other's chunk.
+  class ModuleCache {
+  public:
+    ModuleCache(std::string directory, bool isOptimized);
+
+    std::shared_ptr<const Chunk> load(std::string_view source) const;
+    void store(std::string_view source, const Chunk& chunk) const;
+
+  private:
+    std::string pathFor(std::string_view source) const;
+
+    const std::string directory_;
+    const bool isOptimized_;
+  };
+}
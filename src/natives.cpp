@@ -0,0 +1,16 @@
+#include "natives.h"
+
+#include "vm.h"
+#include <chrono>
+
+namespace {
+  Lox::Value clockNative(Lox::VM&, const Lox::Value*) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+}
+
+namespace Lox {
+  void defineStandardNatives(VM& vm) {
+    vm.defineNative("clock", 0, clockNative);
+  }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+namespace Lox {
+  class VM;
+
+  // clock() returns seconds on a monotonic clock, so the difference between two calls times the code between them.
+  void defineStandardNatives(VM& vm);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <variant>
+
+namespace Lox {
+  class Chunk;
+  class VM;
+
+  enum class ObjType {
+    String,
+    Native,
+    Function
+  };
+
+  struct Obj {
+    // Constants belong to their chunk, which may be shared between VMs, so no collector ever marks or frees them.
+    Obj(ObjType type, bool isConstant)
+      : type(type), isConstant(isConstant) {}
+
+    virtual ~Obj() = default;
+
+    const ObjType type;
+    const bool isConstant;
+    bool isMarked { false };
+    Obj* next { nullptr };
+  };
+
+  struct ObjString : public Obj {
+    ObjString(std::string&& chars, bool isConstant)
+      : Obj(ObjType::String, isConstant), chars(std::move(chars)) {}
+
+    const std::string chars;
+  };
+
+  struct ObjNative;
+  struct ObjFunction;
+
+  using Value = std::variant<std::monostate, bool, double, ObjString*, ObjNative*, ObjFunction*>;
+
+  // Arguments are a window onto the caller's stack, holding exactly as many values as the native's arity.
+  using NativeFunction = Value (*)(VM& vm, const Value* arguments);
+
+  // Natives belong to the VM they were defined on and are never collected.
+  struct ObjNative : public Obj {
+    ObjNative(std::string&& name, size_t arity, NativeFunction function)
+      : Obj(ObjType::Native, true), name(std::move(name)), arity(arity), function(function) {}
+
+    const std::string name;
+    const size_t arity;
+    const NativeFunction function;
+  };
+
+  // A function is a constant of the chunk that declares it. Its own chunk must have passed the verifier, since calls
+  // trust it, and its arity is the number of parameters. Whoever keeps a function beyond the declaring chunk holds it
+  // through shared_from_this.
+  struct ObjFunction : public Obj, public std::enable_shared_from_this<ObjFunction> {
+    ObjFunction(std::string&& name, std::shared_ptr<const Chunk> chunk)
+      : Obj(ObjType::Function, true), name(std::move(name)), chunk(std::move(chunk)) {}
+
+    const std::string name;
+    const std::shared_ptr<const Chunk> chunk;
+  };
+
+  // Strings are compared by content, since a constant and a runtime string with the same text are distinct objects.
+  inline bool valuesEqual(const Value& left, const Value& right) {
+    const auto leftString = std::get_if<ObjString*>(&left);
+    const auto rightString = std::get_if<ObjString*>(&right);
+    if (leftString && rightString) return (*leftString)->chars == (*rightString)->chars;
+
+    return left == right;
+  }
+}
@@ -0,0 +1,781 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <set>
+#include <unordered_map>
+
+namespace {
+  using Lox::OpCode;
+
+  // Only leaf functions this small are inlined, which also keeps recursion out.
+  constexpr size_t maxInlinedInstructions = 32;
+  constexpr auto maxSlots = static_cast<size_t>(std::numeric_limits<unsigned char>::max()) + 1;
+
+  constexpr bool isJump(OpCode opCode) {
+    return
+      opCode == OpCode::Jump ||
+      opCode == OpCode::JumpIfTrue ||
+      opCode == OpCode::JumpIfFalse ||
+      opCode == OpCode::PopJumpIfTrue ||
+      opCode == OpCode::PopJumpIfFalse;
+  }
+
+  constexpr bool isPoppingJump(OpCode opCode) { return opCode == OpCode::PopJumpIfTrue || opCode == OpCode::PopJumpIfFalse; }
+
+  // These have a backward form to lower to: Loop and PopLoopIfTrue.
+  constexpr bool canJumpBackward(OpCode opCode) { return opCode == OpCode::Jump || opCode == OpCode::PopJumpIfTrue; }
+
+  constexpr bool isTerminator(OpCode opCode) { return opCode == OpCode::Jump || Lox::isReturn(opCode); }
+
+  constexpr bool isPurePush(OpCode opCode) {
+    return
+      opCode == OpCode::Constant ||
+      opCode == OpCode::Nil ||
+      opCode == OpCode::True ||
+      opCode == OpCode::False ||
+      opCode == OpCode::GetLocal;
+  }
+}
+
+namespace Lox {
+  // Inlined bodies can push a jump out of range, in which case the chunk is optimized again without them.
+  std::unique_ptr<Chunk> Optimizer::optimize(std::unique_ptr<Chunk> chunk, bool isProgram) {
+    auto optimized = run(*chunk, isProgram);
+    if (!optimized && hasInlined_) optimized = run(*chunk, false);
+
+    return optimized ? std::move(optimized) : std::move(chunk);
+  }
+
+  std::unique_ptr<Chunk> Optimizer::run(const Chunk& chunk, bool shouldInline) {
+    buildBlocks(chunk);
+    simplify();
+
+    if (shouldInline && computeDepths() && inlineCalls()) simplify();
+    if (computeDepths() && eliminateDeadStores()) eliminateDeadPushes();
+
+    return lower();
+  }
+
+  // Backward branches are represented by their forward forms in the IR; the direction is decided again when lowering.
+  void Optimizer::buildBlocks(const Chunk& chunk) {
+    std::vector<std::pair<size_t, Instruction>> instructions {};
+    std::vector<bool> isLeader(chunk.size() + 1, false);
+    isLeader[0] = true;
+
+    for (size_t offset = 0; offset < chunk.size();) {
+      auto opCode = static_cast<OpCode>(chunk.read(offset));
+      const auto argument = hasOperand(opCode) ? chunk.read(offset + 1) : std::byte { 0 };
+      const auto next = offset + (hasOperand(opCode) ? 2 : 1);
+
+      auto target = std::numeric_limits<size_t>::max();
+      if (isBranch(opCode)) target = branchTarget(opCode, next, static_cast<size_t>(argument));
+      if (opCode == OpCode::Loop) opCode = OpCode::Jump;
+      if (opCode == OpCode::PopLoopIfTrue) opCode = OpCode::PopJumpIfTrue;
+
+      if (isJump(opCode)) isLeader[target] = true;
+      if (isJump(opCode) || isReturn(opCode)) isLeader[next] = true;
+
+      instructions.emplace_back(offset, Instruction { opCode, argument, target, chunk.getPosition(offset) });
+      offset = next;
+    }
+
+    arity_ = chunk.arity();
+    constants_.clear();
+    for (size_t i = 0; i < chunk.constantCount(); ++i) constants_.push_back(chunk.getConstant(i));
+
+    blocks_.clear();
+    std::vector<size_t> blockAt(chunk.size() + 1, 0);
+    for (const auto& [offset, instruction] : instructions) {
+      if (isLeader[offset]) blocks_.push_back({ {}, std::nullopt, true });
+
+      blockAt[offset] = blocks_.size() - 1;
+      blocks_.back().instructions.push_back(instruction);
+    }
+
+    for (auto& block : blocks_) {
+      for (auto& instruction : block.instructions) {
+        if (isJump(instruction.opCode)) instruction.target = blockAt[instruction.target];
+      }
+    }
+  }
+
+  void Optimizer::simplify() {
+    for (auto changed = true; changed;) {
+      changed = foldConstantBranches();
+      changed |= removeUnreachableBlocks();
+      changed |= threadJumps();
+      changed |= mergeBlocks();
+      changed |= eliminateDeadPushes();
+    }
+  }
+
+  // Every constant is a number, string or function, so `if (false)`, `while (true)` and the like are decided statically.
+  bool Optimizer::foldConstantBranches() {
+    auto changed = false;
+    for (auto& block : blocks_) {
+      auto& instructions = block.instructions;
+      if (!block.isLive || instructions.size() < 2) continue;
+
+      const auto opCode = instructions.back().opCode;
+      if (!isJump(opCode) || opCode == OpCode::Jump) continue;
+
+      const auto condition = instructions.crbegin()[1].opCode;
+      if (!isPurePush(condition) || condition == OpCode::GetLocal) continue;
+
+      const auto isTruthy = condition != OpCode::Nil && condition != OpCode::False;
+      const auto isTaken = isTruthy == (opCode == OpCode::JumpIfTrue || opCode == OpCode::PopJumpIfTrue);
+      if (isTaken) {
+        instructions.back().opCode = OpCode::Jump;
+      } else {
+        instructions.pop_back();
+      }
+      if (isPoppingJump(opCode)) instructions.erase(instructions.end() - (isTaken ? 2 : 1));
+      changed = true;
+    }
+
+    return changed;
+  }
+
+  bool Optimizer::removeUnreachableBlocks() {
+    std::vector<bool> isReachable(blocks_.size(), false);
+    std::vector<size_t> worklist { 0 };
+    isReachable[0] = true;
+
+    while (!worklist.empty()) {
+      const auto index = worklist.back();
+      worklist.pop_back();
+
+      for (auto successor : successors(index)) {
+        if (isReachable[successor]) continue;
+
+        isReachable[successor] = true;
+        worklist.push_back(successor);
+      }
+    }
+
+    auto changed = false;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (!blocks_[i].isLive || isReachable[i]) continue;
+
+      blocks_[i].isLive = false;
+      changed = true;
+    }
+
+    return changed;
+  }
+
+  bool Optimizer::threadJumps() {
+    const auto resolve = [this](size_t index) {
+      for (auto steps = blocks_.size(); steps > 0; --steps) {
+        const auto& instructions = blocks_[index].instructions;
+        if (instructions.empty()) {
+          const auto next = nextLiveBlock(index);
+          if (!next) break;
+
+          index = *next;
+        } else if (instructions.size() == 1 && instructions.front().opCode == OpCode::Jump) {
+          index = instructions.front().target;
+        } else {
+          break;
+        }
+      }
+      return index;
+    };
+
+    auto changed = false;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      auto& instructions = blocks_[i].instructions;
+      if (!blocks_[i].isLive || instructions.empty() || !isJump(instructions.back().opCode)) continue;
+
+      auto& jump = instructions.back();
+      const auto target = resolve(jump.target);
+      if (target != jump.target && (canJumpBackward(jump.opCode) || target > i)) {
+        jump.target = target;
+        changed = true;
+      }
+
+      if (jump.target == nextLiveBlock(i)) {
+        if (isPoppingJump(jump.opCode)) {
+          jump.opCode = OpCode::Pop;
+        } else {
+          instructions.pop_back();
+        }
+        changed = true;
+      }
+    }
+
+    return changed;
+  }
+
+  bool Optimizer::mergeBlocks() {
+    auto predecessors = predecessorCounts();
+
+    auto changed = false;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (!blocks_[i].isLive) continue;
+
+      for (;;) {
+        auto& instructions = blocks_[i].instructions;
+        if (!instructions.empty() && (isJump(instructions.back().opCode) || isTerminator(instructions.back().opCode))) {
+          break;
+        }
+
+        const auto next = nextLiveBlock(i);
+        if (!next || predecessors[*next] != 1) break;
+
+        auto& absorbed = blocks_[*next];
+        instructions.insert(instructions.end(), absorbed.instructions.cbegin(), absorbed.instructions.cend());
+        absorbed.instructions.clear();
+        absorbed.isLive = false;
+        changed = true;
+      }
+    }
+
+    return changed;
+  }
+
+  bool Optimizer::eliminateDeadPushes() {
+    auto changed = false;
+    for (auto& block : blocks_) {
+      if (!block.isLive) continue;
+
+      std::vector<Instruction> instructions {};
+      for (const auto& instruction : block.instructions) {
+        if (instruction.opCode == OpCode::Pop && !instructions.empty() && isPurePush(instructions.back().opCode)) {
+          instructions.pop_back();
+          changed = true;
+        } else {
+          instructions.push_back(instruction);
+        }
+      }
+      block.instructions = std::move(instructions);
+    }
+
+    return changed;
+  }
+
+  bool Optimizer::computeDepths() {
+    for (auto& block : blocks_) block.entryDepth.reset();
+
+    blocks_[0].entryDepth = arity_;
+    std::vector<size_t> worklist { 0 };
+    while (!worklist.empty()) {
+      const auto index = worklist.back();
+      worklist.pop_back();
+
+      auto depth = *blocks_[index].entryDepth;
+      for (const auto& instruction : blocks_[index].instructions) {
+        const auto effect = stackEffect(instruction.opCode, static_cast<size_t>(instruction.argument));
+        if (depth < effect.pops) return false;
+
+        depth += effect.pushes - effect.pops;
+      }
+
+      for (auto successor : successors(index)) {
+        auto& entryDepth = blocks_[successor].entryDepth;
+        if (entryDepth && *entryDepth != depth) return false;
+        if (entryDepth) continue;
+
+        entryDepth = depth;
+        worklist.push_back(successor);
+      }
+    }
+
+    return true;
+  }
+
+  // A store to a local is dead if no path reads the slot again before it is overwritten or popped.
+  bool Optimizer::eliminateDeadStores() {
+    std::vector<LiveLocals> liveIn(blocks_.size());
+    for (auto changed = true; changed;) {
+      changed = false;
+      for (auto i = blocks_.size(); i-- > 0;) {
+        if (!blocks_[i].isLive) continue;
+
+        LiveLocals liveOut {};
+        for (auto successor : successors(i)) liveOut |= liveIn[successor];
+
+        const auto live = computeLiveIn(i, liveOut);
+        if (live == liveIn[i]) continue;
+
+        liveIn[i] = live;
+        changed = true;
+      }
+    }
+
+    auto changed = false;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (!blocks_[i].isLive) continue;
+
+      LiveLocals liveOut {};
+      for (auto successor : successors(i)) liveOut |= liveIn[successor];
+
+      auto& instructions = blocks_[i].instructions;
+      std::vector<bool> deadStores(instructions.size(), false);
+      computeLiveIn(i, liveOut, &deadStores);
+
+      std::vector<Instruction> liveInstructions {};
+      for (size_t j = 0; j < instructions.size(); ++j) {
+        if (!deadStores[j]) liveInstructions.push_back(instructions[j]);
+      }
+
+      changed |= liveInstructions.size() != instructions.size();
+      instructions = std::move(liveInstructions);
+    }
+
+    return changed;
+  }
+
+  // The callee's Constant and GetGlobal become a Nil holding the result slot, and the call's block is split around the
+  // body, whose returns store into that slot, pop down to it and jump on.
+  bool Optimizer::inlineCalls() {
+    const auto sites = findInlinableCalls();
+
+    std::map<Location, std::vector<BasicBlock>> bodies {};
+    std::set<Location> callees {};
+    for (const auto& site : sites) {
+      auto body = inlinedBody(site);
+      if (!body) continue;
+
+      bodies.emplace(site.call, std::move(*body));
+      callees.insert(site.callee);
+    }
+    if (bodies.empty()) return false;
+
+    std::vector<size_t> newIndex(blocks_.size(), 0);
+    size_t count = 0;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      newIndex[i] = count++;
+      for (auto body = bodies.lower_bound({ i, 0 }); body != bodies.cend() && body->first.first == i; ++body) {
+        count += body->second.size() + 1;
+      }
+    }
+
+    std::vector<BasicBlock> blocks {};
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      blocks.push_back({ {}, std::nullopt, blocks_[i].isLive });
+
+      const auto& instructions = blocks_[i].instructions;
+      for (size_t j = 0; j < instructions.size(); ++j) {
+        auto instruction = instructions[j];
+        if (callees.count({ i, j + 1 })) instruction = { OpCode::Nil, std::byte { 0 }, instruction.target, instruction.position };
+        if (callees.count({ i, j })) continue;
+        if (isJump(instruction.opCode)) instruction.target = newIndex[instruction.target];
+
+        const auto body = bodies.find({ i, j });
+        if (body == bodies.end()) {
+          blocks.back().instructions.push_back(instruction);
+          continue;
+        }
+
+        const auto start = blocks.size();
+        for (auto& block : body->second) {
+          for (auto& inlined : block.instructions) {
+            if (isJump(inlined.opCode)) inlined.target += start;
+          }
+          blocks.push_back(std::move(block));
+        }
+        blocks.push_back({ {}, std::nullopt, true });
+      }
+    }
+
+    blocks_ = std::move(blocks);
+    hasInlined_ = true;
+    return true;
+  }
+
+  std::unique_ptr<Chunk> Optimizer::lower() const {
+    std::vector<size_t> offsets(blocks_.size(), 0);
+    size_t offset = 0;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      offsets[i] = offset;
+      if (!blocks_[i].isLive) continue;
+
+      for (const auto& instruction : blocks_[i].instructions) offset += hasOperand(instruction.opCode) ? 2 : 1;
+    }
+
+    auto optimized = std::make_unique<Chunk>();
+    optimized->setArity(arity_);
+
+    std::vector<std::byte> constantMap(constants_.size());
+    for (size_t i = 0; i < constants_.size(); ++i) {
+      const auto index = optimized->copyConstant(constants_[i]);
+      if (index >= maxSlots) return nullptr;
+
+      constantMap[i] = static_cast<std::byte>(index);
+    }
+
+    for (const auto& block : blocks_) {
+      if (!block.isLive) continue;
+
+      for (auto instruction : block.instructions) {
+        if (isJump(instruction.opCode)) {
+          const auto next = optimized->size() + 2;
+          const auto target = offsets[instruction.target];
+          if (target < next && !canJumpBackward(instruction.opCode)) return nullptr;
+          if (target < next) instruction.opCode = instruction.opCode == OpCode::Jump ? OpCode::Loop : OpCode::PopLoopIfTrue;
+
+          const auto distance = target < next ? next - target : target - next;
+          if (distance > std::numeric_limits<unsigned char>::max()) return nullptr;
+
+          instruction.argument = static_cast<std::byte>(distance);
+        }
+
+        if (instruction.opCode == OpCode::Constant) instruction.argument = constantMap[static_cast<size_t>(instruction.argument)];
+
+        optimized->write(instruction.opCode, instruction.position);
+        if (hasOperand(instruction.opCode)) optimized->write(instruction.argument);
+      }
+    }
+
+    return optimized;
+  }
+
+  // A call is inlined when its callee is read straight from a global that only this program's one declaration of a
+  // small leaf function sets, and that declaration comes first. Natives, linked modules and restored snapshots are
+  // trusted not to assign the program's globals.
+  std::vector<Optimizer::CallSite> Optimizer::findInlinableCalls() const {
+    std::unordered_set<std::string_view> assigned {};
+    if (!collectAssignedGlobals(assigned)) return {};
+
+    const auto nameAt = [this](const std::optional<Location>& origin) -> std::optional<std::string_view> {
+      if (!origin) return std::nullopt;
+
+      const auto& instruction = blocks_[origin->first].instructions[origin->second];
+      if (instruction.opCode != OpCode::Constant) return std::nullopt;
+
+      const auto string = std::get_if<ObjString*>(&constants_[static_cast<size_t>(instruction.argument)]);
+      return string ? std::optional { std::string_view { (*string)->chars } } : std::nullopt;
+    };
+
+    const auto functionAt = [this](const std::optional<Location>& origin) -> const ObjFunction* {
+      if (!origin) return nullptr;
+
+      const auto& instruction = blocks_[origin->first].instructions[origin->second];
+      if (instruction.opCode != OpCode::Constant) return nullptr;
+
+      const auto function = std::get_if<ObjFunction*>(&constants_[static_cast<size_t>(instruction.argument)]);
+      return function ? *function : nullptr;
+    };
+
+    struct Declaration {
+      Location location;
+      const ObjFunction* function;
+      bool isUnique;
+    };
+
+    std::unordered_map<std::string_view, Declaration> declarations {};
+    std::vector<std::pair<Location, std::optional<Location>>> calls {};
+    std::map<Location, size_t> reads {};
+
+    const auto entries = trackOrigins();
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (!blocks_[i].isLive || !entries[i]) continue;
+
+      auto origins = *entries[i];
+      const auto& instructions = blocks_[i].instructions;
+      for (size_t j = 0; j < instructions.size(); ++j) {
+        const auto& instruction = instructions[j];
+        if (instruction.opCode == OpCode::DefineGlobal) {
+          const auto name = nameAt(origins.crbegin()[1]);
+          if (!name) return {};
+
+          const auto [declaration, isNew] = declarations.try_emplace(*name, Declaration { { i, j }, functionAt(origins.back()), true });
+          if (!isNew) declaration->second.isUnique = false;
+        }
+
+        if (instruction.opCode == OpCode::Call) {
+          calls.emplace_back(Location { i, j }, origins.crbegin()[static_cast<size_t>(instruction.argument)]);
+        }
+
+        applyOrigins({ i, j }, origins, &reads);
+      }
+    }
+
+    std::vector<CallSite> sites {};
+    for (const auto& [call, callee] : calls) {
+      if (!callee || callee->second == 0 || reads[*callee] != 1) continue;
+      if (blocks_[callee->first].instructions[callee->second].opCode != OpCode::GetGlobal) continue;
+
+      const auto name = nameAt(Location { callee->first, callee->second - 1 });
+      if (!name || assigned.count(*name)) continue;
+
+      const auto declaration = declarations.find(*name);
+      if (declaration == declarations.cend()) continue;
+
+      const auto& [location, function, isUnique] = declaration->second;
+      if (!function || !isUnique || location > *callee) continue;
+
+      const auto& [block, index] = call;
+      const auto argumentCount = static_cast<size_t>(blocks_[block].instructions[index].argument);
+      if (function->chunk->arity() != argumentCount) continue;
+
+      auto depth = *blocks_[block].entryDepth;
+      for (size_t j = 0; j < index; ++j) {
+        const auto& instruction = blocks_[block].instructions[j];
+        const auto effect = stackEffect(instruction.opCode, static_cast<size_t>(instruction.argument));
+        depth += effect.pushes - effect.pops;
+      }
+
+      const auto base = depth - argumentCount;
+      if (base + function->chunk->maxStackDepth() > maxSlots) continue;
+
+      sites.push_back({ *callee, call, function, base });
+    }
+
+    return sites;
+  }
+
+  // The body's own blocks, with jumps between them and to one past the last, where the caller continues.
+  std::optional<std::vector<Optimizer::BasicBlock>> Optimizer::inlinedBody(const CallSite& site) {
+    Optimizer callee {};
+    callee.buildBlocks(*site.function->chunk);
+    if (!callee.computeDepths()) return std::nullopt;
+
+    size_t instructionCount = 0;
+    for (const auto& block : callee.blocks_) {
+      for (const auto& instruction : block.instructions) {
+        if (instruction.opCode == OpCode::Call || instruction.opCode == OpCode::Return) return std::nullopt;
+        ++instructionCount;
+      }
+    }
+    if (instructionCount > maxInlinedInstructions) return std::nullopt;
+
+    const auto constantCount = constants_.size();
+    const auto end = callee.blocks_.size();
+    std::vector<BasicBlock> body {};
+    for (const auto& block : callee.blocks_) {
+      body.push_back({ {}, std::nullopt, block.isLive && block.entryDepth });
+      if (!body.back().isLive) continue;
+
+      auto& instructions = body.back().instructions;
+      auto depth = *block.entryDepth;
+      for (auto instruction : block.instructions) {
+        const auto effect = stackEffect(instruction.opCode, static_cast<size_t>(instruction.argument));
+        const auto slot = static_cast<size_t>(instruction.argument);
+
+        if (instruction.opCode == OpCode::ReturnValue) {
+          const auto result = static_cast<std::byte>(site.base - 1);
+          instructions.push_back({ OpCode::SetLocal, result, std::numeric_limits<size_t>::max(), instruction.position });
+          for (auto pops = depth; pops > 0; --pops) {
+            instructions.push_back({ OpCode::Pop, std::byte { 0 }, std::numeric_limits<size_t>::max(), instruction.position });
+          }
+          instructions.push_back({ OpCode::Jump, std::byte { 0 }, end, instruction.position });
+          break;
+        }
+
+        if (instruction.opCode == OpCode::GetLocal || instruction.opCode == OpCode::SetLocal) {
+          instruction.argument = static_cast<std::byte>(site.base + slot);
+        }
+
+        if (instruction.opCode == OpCode::Constant) {
+          const auto index = addConstant(callee.constants_[slot]);
+          if (index >= maxSlots) {
+            constants_.erase(constants_.begin() + static_cast<std::ptrdiff_t>(constantCount), constants_.end());
+            return std::nullopt;
+          }
+
+          instruction.argument = static_cast<std::byte>(index);
+        }
+
+        instructions.push_back(instruction);
+        depth += effect.pushes - effect.pops;
+      }
+    }
+
+    return body;
+  }
+
+  // Fails when some assignment's name is not a constant, in which case any global may be assigned.
+  bool Optimizer::collectAssignedGlobals(std::unordered_set<std::string_view>& names) const {
+    const auto entries = trackOrigins();
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (!blocks_[i].isLive || !entries[i]) continue;
+
+      auto origins = *entries[i];
+      const auto& instructions = blocks_[i].instructions;
+      for (size_t j = 0; j < instructions.size(); ++j) {
+        if (instructions[j].opCode == OpCode::SetGlobal) {
+          const auto origin = origins.crbegin()[1];
+          if (!origin) return false;
+
+          const auto& name = blocks_[origin->first].instructions[origin->second];
+          if (name.opCode != OpCode::Constant) return false;
+
+          const auto string = std::get_if<ObjString*>(&constants_[static_cast<size_t>(name.argument)]);
+          if (!string) return false;
+
+          names.insert((*string)->chars);
+        }
+
+        applyOrigins({ i, j }, origins);
+      }
+    }
+
+    for (const auto& constant : constants_) {
+      const auto function = std::get_if<ObjFunction*>(&constant);
+      if (!function) continue;
+
+      Optimizer nested {};
+      nested.buildBlocks(*(*function)->chunk);
+      if (!nested.computeDepths() || !nested.collectAssignedGlobals(names)) return false;
+    }
+
+    return true;
+  }
+
+  // Indexed by block; a block no path reaches has no origins.
+  std::vector<std::optional<Optimizer::Origins>> Optimizer::trackOrigins() const {
+    std::vector<std::optional<Origins>> entries(blocks_.size());
+    entries[0] = Origins(arity_);
+
+    std::vector<size_t> worklist { 0 };
+    while (!worklist.empty()) {
+      const auto index = worklist.back();
+      worklist.pop_back();
+
+      auto origins = *entries[index];
+      for (size_t j = 0; j < blocks_[index].instructions.size(); ++j) applyOrigins({ index, j }, origins);
+
+      for (auto successor : successors(index)) {
+        auto& entry = entries[successor];
+        if (!entry) {
+          entry = origins;
+          worklist.push_back(successor);
+          continue;
+        }
+
+        auto changed = false;
+        for (size_t k = 0; k < entry->size() && k < origins.size(); ++k) {
+          if (!(*entry)[k] || (*entry)[k] == origins[k]) continue;
+
+          (*entry)[k].reset();
+          changed = true;
+        }
+        if (changed) worklist.push_back(successor);
+      }
+    }
+
+    return entries;
+  }
+
+  // Counts in reads how often each origin's value is consumed; a Pop only discards it.
+  void Optimizer::applyOrigins(Location location, Origins& origins, std::map<Location, size_t>* reads) const {
+    const auto& instruction = blocks_[location.first].instructions[location.second];
+    const auto slot = static_cast<size_t>(instruction.argument);
+    const auto read = [reads](const std::optional<Location>& origin) {
+      if (reads && origin) ++(*reads)[*origin];
+    };
+
+    if (instruction.opCode == OpCode::GetLocal) {
+      read(origins[slot]);
+      origins.emplace_back();
+      return;
+    }
+
+    if (instruction.opCode == OpCode::SetLocal) {
+      read(origins.back());
+      origins[slot].reset();
+      return;
+    }
+
+    const auto effect = stackEffect(instruction.opCode, slot);
+    const auto lowest = origins.size() - effect.pops;
+    if (instruction.opCode != OpCode::Pop) {
+      for (auto k = lowest; k < origins.size(); ++k) read(origins[k]);
+    }
+    origins.resize(lowest);
+
+    const auto isOrigin = instruction.opCode == OpCode::Constant || instruction.opCode == OpCode::GetGlobal;
+    for (size_t k = 0; k < effect.pushes; ++k) {
+      origins.push_back(isOrigin ? std::optional { location } : std::nullopt);
+    }
+  }
+
+  // Strings are matched by content, since the callee's come from another chunk.
+  size_t Optimizer::addConstant(const Value& value) {
+    const auto isSame = [&value](const Value& constant) {
+      if (constant.index() != value.index()) return false;
+
+      if (const auto string = std::get_if<ObjString*>(&value)) return (*string)->chars == std::get<ObjString*>(constant)->chars;
+      if (const auto number = std::get_if<double>(&value)) return std::memcmp(number, &std::get<double>(constant), sizeof(double)) == 0;
+      return constant == value;
+    };
+
+    const auto existing = std::find_if(constants_.cbegin(), constants_.cend(), isSame);
+    if (existing != constants_.cend()) return static_cast<size_t>(existing - constants_.cbegin());
+
+    constants_.push_back(value);
+    return constants_.size() - 1;
+  }
+
+  Optimizer::LiveLocals Optimizer::computeLiveIn(size_t index, LiveLocals live, std::vector<bool>* deadStores) const {
+    const auto& instructions = blocks_[index].instructions;
+
+    std::vector<size_t> depths { *blocks_[index].entryDepth };
+    for (const auto& instruction : instructions) {
+      const auto effect = stackEffect(instruction.opCode, static_cast<size_t>(instruction.argument));
+      depths.push_back(depths.back() + effect.pushes - effect.pops);
+    }
+
+    for (auto j = instructions.size(); j-- > 0;) {
+      const auto& instruction = instructions[j];
+      const auto slot = static_cast<size_t>(instruction.argument);
+
+      if (instruction.opCode == OpCode::SetLocal) {
+        const auto isDead = !live[slot] && j + 1 < instructions.size() && instructions[j + 1].opCode == OpCode::Pop;
+        if (deadStores && isDead) (*deadStores)[j] = true;
+
+        live.reset(slot);
+        if (depths[j] - 1 < live.size()) live.set(depths[j] - 1);
+        continue;
+      }
+
+      // Operands an instruction consumes are read, unless it merely discards them.
+      const auto effect = stackEffect(instruction.opCode, static_cast<size_t>(instruction.argument));
+      const auto lowest = depths[j] - effect.pops;
+      for (auto k = lowest; k < std::max(depths[j], depths[j + 1]) && k < live.size(); ++k) live.reset(k);
+      if (instruction.opCode != OpCode::Pop) {
+        for (auto k = lowest; k < depths[j] && k < live.size(); ++k) live.set(k);
+      }
+
+      if (instruction.opCode == OpCode::GetLocal) live.set(slot);
+    }
+
+    return live;
+  }
+
+  std::optional<size_t> Optimizer::nextLiveBlock(size_t index) const {
+    for (auto i = index + 1; i < blocks_.size(); ++i) {
+      if (blocks_[i].isLive) return i;
+    }
+
+    return std::nullopt;
+  }
+
+  std::vector<size_t> Optimizer::successors(size_t index) const {
+    std::vector<size_t> result {};
+
+    const auto& instructions = blocks_[index].instructions;
+    if (!instructions.empty() && isJump(instructions.back().opCode)) result.push_back(instructions.back().target);
+
+    if (instructions.empty() || !isTerminator(instructions.back().opCode)) {
+      if (const auto next = nextLiveBlock(index)) result.push_back(*next);
+    }
+
+    return result;
+  }
+
+  std::vector<size_t> Optimizer::predecessorCounts() const {
+    std::vector<size_t> counts(blocks_.size(), 0);
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (!blocks_[i].isLive) continue;
+
+      for (auto successor : successors(i)) counts[successor]++;
+    }
+
+    return counts;
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "chunk.h"
+#include <bitset>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace Lox {
+  class Optimizer {
+  public:
+    // Returns the original chunk untouched if the optimized form cannot be encoded. A program's top-level code also
+    // has its calls to small functions the program declares replaced by their bodies.
+    std::unique_ptr<Chunk> optimize(std::unique_ptr<Chunk> chunk, bool isProgram = false);
+
+  private:
+    struct Instruction {
+      OpCode opCode;
+      std::byte argument;
+      size_t target;
+      std::pair<unsigned, unsigned> position;
+    };
+
+    struct BasicBlock {
+      std::vector<Instruction> instructions;
+      std::optional<size_t> entryDepth;
+      bool isLive;
+    };
+
+    // A block index and an instruction index within it.
+    using Location = std::pair<size_t, size_t>;
+    // For each stack slot, the Constant or GetGlobal that pushed its value, where all paths agree on one.
+    using Origins = std::vector<std::optional<Location>>;
+
+    struct CallSite {
+      Location callee;
+      Location call;
+      const ObjFunction* function;
+      size_t base;
+    };
+
+    using LiveLocals = std::bitset<256>;
+
+    std::unique_ptr<Chunk> run(const Chunk& chunk, bool shouldInline);
+    void buildBlocks(const Chunk& chunk);
+    void simplify();
+    bool foldConstantBranches();
+    bool removeUnreachableBlocks();
+    bool threadJumps();
+    bool mergeBlocks();
+    bool eliminateDeadPushes();
+    bool computeDepths();
+    bool eliminateDeadStores();
+    bool inlineCalls();
+    std::unique_ptr<Chunk> lower() const;
+
+    std::vector<CallSite> findInlinableCalls() const;
+    std::optional<std::vector<BasicBlock>> inlinedBody(const CallSite& site);
+    bool collectAssignedGlobals(std::unordered_set<std::string_view>& names) const;
+    std::vector<std::optional<Origins>> trackOrigins() const;
+    void applyOrigins(Location location, Origins& origins, std::map<Location, size_t>* reads = nullptr) const;
+    size_t addConstant(const Value& value);
+
+    LiveLocals computeLiveIn(size_t index, LiveLocals live, std::vector<bool>* deadStores = nullptr) const;
+    std::optional<size_t> nextLiveBlock(size_t index) const;
+    std::vector<size_t> successors(size_t index) const;
+    std::vector<size_t> predecessorCounts() const;
+
+    std::vector<BasicBlock> blocks_ {};
+    std::vector<Value> constants_ {};
+    size_t arity_ { 0 };
+    bool hasInlined_ { false };
+  };
+}
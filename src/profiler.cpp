@@ -0,0 +1,104 @@
+#include "profiler.h"
+
+#include "chunk.h"
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <ostream>
+#include <stdexcept>
+#include <sys/time.h>
+#include <vector>
+
+namespace {
+  // At the default interval this holds over four minutes of samples between two leave calls.
+  constexpr size_t sampleCapacity = 1 << 18;
+
+  std::atomic<const size_t*> currentOffset { nullptr };
+  std::atomic<size_t> sampleCount { 0 };
+  std::atomic<size_t> outsideCount { 0 };
+  std::atomic<size_t> droppedCount { 0 };
+  std::array<size_t, sampleCapacity> samples;
+  struct sigaction previousAction {};
+
+  void handleSample(int) {
+    const auto offset = currentOffset.load(std::memory_order_relaxed);
+    if (!offset) {
+      outsideCount.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    const auto index = sampleCount.load(std::memory_order_relaxed);
+    if (index == sampleCapacity) {
+      droppedCount.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    samples[index] = *offset;
+    sampleCount.store(index + 1, std::memory_order_relaxed);
+  }
+
+  void setTimer(std::chrono::microseconds interval) {
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(interval);
+    itimerval timer {};
+    timer.it_interval.tv_sec = static_cast<time_t>(seconds.count());
+    timer.it_interval.tv_usec = static_cast<suseconds_t>((interval - seconds).count());
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+  }
+}
+
+namespace Lox {
+  Profiler::Profiler(std::chrono::microseconds interval) {
+    struct sigaction action {};
+    action.sa_handler = handleSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previousAction) != 0) throw std::runtime_error { "Could not install the profiler." };
+
+    sampleCount = 0;
+    outsideCount = 0;
+    droppedCount = 0;
+    setTimer(interval);
+  }
+
+  Profiler::~Profiler() {
+    setTimer(std::chrono::microseconds { 0 });
+    sigaction(SIGPROF, &previousAction, nullptr);
+  }
+
+  void Profiler::enter(const size_t& offset) noexcept {
+    currentOffset.store(&offset, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+
+  void Profiler::leave(const Chunk& chunk) {
+    currentOffset.store(nullptr, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    const auto count = sampleCount.load(std::memory_order_relaxed);
+    if (count == 0) return;
+
+    // A sample may land on an operand byte, so each offset is attributed to the instruction containing it.
+    std::vector<size_t> instructionStarts(chunk.size(), 0);
+    for (size_t offset = 0; offset < chunk.size();) {
+      const auto length = hasOperand(static_cast<OpCode>(chunk.read(offset))) ? 2 : 1;
+      for (auto i = 0; i < length && offset + i < chunk.size(); ++i) instructionStarts[offset + i] = offset;
+      offset += length;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      if (samples[i] < chunk.size()) counts_[chunk.getPosition(instructionStarts[samples[i]])]++;
+    }
+
+    sampleCount.store(0, std::memory_order_relaxed);
+  }
+
+  void Profiler::write(std::ostream& output, std::string_view root) const {
+    for (const auto& [position, count] : counts_) {
+      output << root << ";line " << position.first << ';' << position.first << ':' << position.second << ' ' << count << '\n';
+    }
+
+    if (const auto outside = outsideCount.load(); outside > 0) output << root << ";(compiler and runtime) " << outside << '\n';
+    if (const auto dropped = droppedCount.load(); dropped > 0) output << root << ";(dropped) " << dropped << '\n';
+  }
+}
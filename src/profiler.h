@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+#include <map>
+#include <string_view>
+#include <utility>
+
+namespace Lox {
+  class Chunk;
+
+  // Samples the running VM's bytecode offset on a SIGPROF timer and attributes the samples to source positions.
+  // The timer is process-wide, so only one profiler may run at a time, with one VM executing at a time.
+  class Profiler {
+  public:
+    explicit Profiler(std::chrono::microseconds interval = std::chrono::microseconds { 1000 });
+    ~Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // Called by the VM around each stretch of execution; samples are resolved against chunk on leave.
+    void enter(const size_t& offset) noexcept;
+    void leave(const Chunk& chunk);
+
+    // Writes collapsed stacks ("root;line N;line:column count"), as consumed by flamegraph.pl and speedscope.
+    void write(std::ostream& output, std::string_view root) const;
+
+  private:
+    std::map<std::pair<unsigned, unsigned>, size_t> counts_ {};
+  };
+}
@@ -0,0 +1,34 @@
+#include "scheduler.h"
+
+namespace Lox {
+  size_t Scheduler::add(VM& vm, std::shared_ptr<const Chunk> chunk) {
+    tasks_.push_back({ vm, std::move(chunk), false });
+    return tasks_.size() - 1;
+  }
+
+  std::vector<ResultStatus> Scheduler::run() {
+    std::vector<ResultStatus> statuses(tasks_.size(), ResultStatus::Suspended);
+
+    std::deque<size_t> ready {};
+    for (size_t i = 0; i < tasks_.size(); ++i) ready.push_back(i);
+
+    while (!ready.empty()) {
+      const auto index = ready.front();
+      ready.pop_front();
+
+      auto& task = tasks_[index];
+      task.vm.setFuel(fuelPerSlice_);
+      statuses[index] = task.hasStarted ? task.vm.resume() : task.vm.run(task.chunk);
+      task.hasStarted = true;
+
+      if (statuses[index] == ResultStatus::Suspended) {
+        ready.push_back(index);
+      } else {
+        task.vm.clearFuel();
+      }
+    }
+
+    tasks_.clear();
+    return statuses;
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "vm.h"
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace Lox {
+  class Chunk;
+
+  // Time-slices many VMs on the calling thread. Each VM runs until it spends its slice of fuel (loop back-edges and
+  // function calls) and is then queued behind the others, so no single script can starve the rest.
+  // A slice of 0 fuel behaves like a slice of 1.
+  class Scheduler {
+  public:
+    explicit Scheduler(size_t fuelPerSlice)
+      : fuelPerSlice_(fuelPerSlice) {}
+
+    size_t add(VM& vm, std::shared_ptr<const Chunk> chunk);
+
+    // Returns the final status of each added VM, in the order they were added.
+    std::vector<ResultStatus> run();
+
+  private:
+    struct Task {
+      VM& vm;
+      std::shared_ptr<const Chunk> chunk;
+      bool hasStarted;
+    };
+
+    const size_t fuelPerSlice_;
+    std::vector<Task> tasks_ {};
+  };
+}
@@ -0,0 +1,48 @@
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace Lox {
+  ThreadPool::ThreadPool(unsigned workerCount)
+    : workerCount_(std::max(workerCount, 1u)), queues_(workerCount_) {}
+
+  void ThreadPool::run(std::vector<Task>&& tasks) {
+    for (size_t i = 0; i < tasks.size(); ++i) queues_[i % workerCount_].tasks.push_back(std::move(tasks[i]));
+
+    std::vector<std::thread> threads {};
+    for (auto worker = 1u; worker < workerCount_; ++worker) threads.emplace_back(&ThreadPool::work, this, worker);
+
+    work(0);
+    for (auto& thread : threads) thread.join();
+  }
+
+  // Tasks never spawn further tasks, so a worker that finds every queue empty is done.
+  void ThreadPool::work(unsigned worker) {
+    while (const auto task = take(worker)) (*task)(worker);
+  }
+
+  std::optional<ThreadPool::Task> ThreadPool::take(unsigned worker) {
+    {
+      auto& own = queues_[worker];
+      const std::lock_guard<std::mutex> lock { own.mutex };
+      if (!own.tasks.empty()) {
+        auto task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return task;
+      }
+    }
+
+    for (auto i = 1u; i < workerCount_; ++i) {
+      auto& victim = queues_[(worker + i) % workerCount_];
+      const std::lock_guard<std::mutex> lock { victim.mutex };
+      if (!victim.tasks.empty()) {
+        auto task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return task;
+      }
+    }
+
+    return std::nullopt;
+  }
+}
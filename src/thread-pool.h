@@ -0,0 +1,34 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace Lox {
+  // Runs a fixed batch of independent tasks. Each worker drains its own deque from the back and,
+  // once that is empty, steals from the front of the others.
+  class ThreadPool {
+  public:
+    using Task = std::function<void(unsigned worker)>;
+
+    explicit ThreadPool(unsigned workerCount);
+
+    constexpr unsigned workerCount() const noexcept { return workerCount_; }
+
+    void run(std::vector<Task>&& tasks);
+
+  private:
+    struct WorkQueue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    void work(unsigned worker);
+    std::optional<Task> take(unsigned worker);
+
+    const unsigned workerCount_;
+    std::vector<WorkQueue> queues_;
+  };
+}
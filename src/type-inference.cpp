@@ -0,0 +1,196 @@
+#include "type-inference.h"
+
+#include "chunk.h"
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace {
+  using Lox::OpCode;
+
+  enum class Type : unsigned char {
+    Unknown,
+    Nil,
+    Bool,
+    Number,
+    String
+  };
+
+  using Types = std::vector<Type>;
+
+  Type typeOf(const Lox::Value& value) {
+    return
+      std::holds_alternative<double>(value) ? Type::Number :
+      std::holds_alternative<Lox::ObjString*>(value) ? Type::String :
+      std::holds_alternative<bool>(value) ? Type::Bool :
+      std::holds_alternative<std::monostate>(value) ? Type::Nil : Type::Unknown;
+  }
+
+  // Results assume the instruction succeeds, since a failing one ends the run.
+  Type addedType(Type left, Type right) {
+    if (left == Type::String || right == Type::String) return Type::String;
+    return left == Type::Number && right == Type::Number ? Type::Number : Type::Unknown;
+  }
+
+  std::optional<OpCode> numberForm(OpCode opCode) {
+    switch (opCode) {
+      case OpCode::Add:
+        return OpCode::AddNumber;
+      case OpCode::Less:
+        return OpCode::LessNumber;
+      case OpCode::Negative:
+        return OpCode::NegateNumber;
+      default:
+        return std::nullopt;
+    }
+  }
+
+  void apply(const Lox::Chunk& chunk, size_t offset, Types& types) {
+    const auto opCode = static_cast<OpCode>(chunk.read(offset));
+    const auto operand = Lox::hasOperand(opCode) ? static_cast<size_t>(chunk.read(offset + 1)) : 0;
+    const auto top = types.empty() ? Type::Unknown : types.back();
+    const auto second = types.size() < 2 ? Type::Unknown : types[types.size() - 2];
+
+    auto result = Type::Unknown;
+    switch (opCode) {
+      case OpCode::Constant:
+        result = typeOf(chunk.getConstant(operand));
+        break;
+      case OpCode::Nil:
+        result = Type::Nil;
+        break;
+      case OpCode::GetLocal:
+        result = types[operand];
+        break;
+      case OpCode::SetLocal:
+        types[operand] = top;
+        return;
+      case OpCode::JumpIfTrue:
+      case OpCode::JumpIfFalse:
+        return;
+      case OpCode::SetGlobal:
+        result = top;
+        break;
+      case OpCode::Add:
+        result = addedType(second, top);
+        break;
+      case OpCode::Subtract:
+      case OpCode::Multiply:
+      case OpCode::Divide:
+      case OpCode::Negative:
+      case OpCode::AddNumber:
+      case OpCode::NegateNumber:
+        result = Type::Number;
+        break;
+      case OpCode::True:
+      case OpCode::False:
+      case OpCode::Equal:
+      case OpCode::NotEqual:
+      case OpCode::Greater:
+      case OpCode::GreaterEqual:
+      case OpCode::Less:
+      case OpCode::LessEqual:
+      case OpCode::LessNumber:
+      case OpCode::Not:
+        result = Type::Bool;
+        break;
+      default:
+        break;
+    }
+
+    const auto effect = Lox::stackEffect(opCode, operand);
+    types.resize(types.size() - effect.pops);
+    if (effect.pushes > 0) types.push_back(result);
+  }
+
+  // Returns whether the state at a merge point widened, in which case its successors must be visited again.
+  bool merge(std::optional<Types>& state, const Types& incoming) {
+    if (!state) {
+      state = incoming;
+      return true;
+    }
+
+    auto isWidened = false;
+    for (size_t i = 0; i < incoming.size(); ++i) {
+      if ((*state)[i] != incoming[i] && (*state)[i] != Type::Unknown) {
+        (*state)[i] = Type::Unknown;
+        isWidened = true;
+      }
+    }
+
+    return isWidened;
+  }
+
+  // The types on entry to every instruction reachable from entry.
+  std::vector<std::optional<Types>> inferTypes(const Lox::Chunk& chunk, size_t entry) {
+    std::vector<std::optional<Types>> states(chunk.size());
+    std::vector<size_t> worklist { entry };
+    states[entry] = Types(chunk.arity(), Type::Unknown);
+    while (!worklist.empty()) {
+      auto offset = worklist.back();
+      worklist.pop_back();
+
+      auto types = *states[offset];
+      while (true) {
+        const auto opCode = static_cast<OpCode>(chunk.read(offset));
+        apply(chunk, offset, types);
+        if (isReturn(opCode)) break;
+
+        const auto next = offset + (hasOperand(opCode) ? 2 : 1);
+        if (isBranch(opCode)) {
+          const auto target = branchTarget(opCode, next, static_cast<size_t>(chunk.read(offset + 1)));
+          if (merge(states[target], types)) worklist.push_back(target);
+          if (isUnconditionalBranch(opCode)) break;
+        }
+
+        if (!merge(states[next], types)) break;
+        offset = next;
+        types = *states[next];
+      }
+    }
+
+    return states;
+  }
+}
+
+namespace Lox {
+  void specializeTypes(Chunk& chunk, size_t entry) {
+    const auto states = inferTypes(chunk, entry);
+    for (size_t offset = entry; offset < chunk.size();) {
+      const auto opCode = static_cast<OpCode>(chunk.read(offset));
+      const auto specialized = numberForm(opCode);
+      if (specialized && states[offset]) {
+        const auto& types = *states[offset];
+        const auto operandCount = opCode == OpCode::Negative ? 1u : 2u;
+        auto isNumeric = true;
+        for (size_t i = types.size() - operandCount; i < types.size(); ++i) isNumeric &= types[i] == Type::Number;
+
+        if (isNumeric) chunk.patch(offset, static_cast<std::byte>(*specialized));
+      }
+
+      offset += hasOperand(opCode) ? 2 : 1;
+    }
+  }
+
+  std::optional<TypeProblem> findTypeProblem(const Chunk& chunk, size_t entry) {
+    const auto states = inferTypes(chunk, entry);
+    for (size_t offset = entry; offset < chunk.size();) {
+      const auto opCode = static_cast<OpCode>(chunk.read(offset));
+      if (states[offset]) {
+        const auto& types = *states[offset];
+        const auto nameDistance = opCode == OpCode::GetGlobal ? 1u : 2u;
+        const auto isGlobal = opCode == OpCode::DefineGlobal || opCode == OpCode::SetGlobal || opCode == OpCode::GetGlobal;
+        if (isGlobal && types[types.size() - nameDistance] != Type::String) return TypeProblem { offset, "global name is not a string." };
+
+        const auto numberCount = opCode == OpCode::NegateNumber ? 1u : opCode == OpCode::AddNumber || opCode == OpCode::LessNumber ? 2u : 0u;
+        for (size_t i = types.size() - numberCount; i < types.size(); ++i) {
+          if (types[i] != Type::Number) return TypeProblem { offset, "operand is not proven to be a number." };
+        }
+      }
+
+      offset += hasOperand(opCode) ? 2 : 1;
+    }
+
+    return std::nullopt;
+  }
+}
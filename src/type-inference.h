@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+
+namespace Lox {
+  class Chunk;
+
+  struct TypeProblem {
+    size_t offset;
+    const char* description;
+  };
+
+  // Infers the type of every stack slot, locals included, along each path from entry and rewrites Add, Less and
+  // Negative into their number-only forms wherever their operands are proven to be numbers.
+  // The chunk must have passed the verifier from the same entry.
+  void specializeTypes(Chunk& chunk, size_t entry = 0);
+
+  // Finds an instruction whose operands the VM would take for granted without proof: a global's name must be a
+  // string, and a number form must only see numbers. The chunk must otherwise have passed the verifier from the same
+  // entry.
+  std::optional<TypeProblem> findTypeProblem(const Chunk& chunk, size_t entry = 0);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "object.h"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace Lox {
+  // A contiguous stack of values with no growth checks on push; the VM reserves each chunk's maximum depth
+  // before running it or calling it as a function, so pushes never reallocate.
+  class ValueStack {
+  public:
+    // Keeps the current contents.
+    void reserve(size_t capacity) {
+      if (capacity <= capacity_) return;
+
+      auto values = std::make_unique<Value[]>(capacity);
+      const auto size = this->size();
+      std::copy(values_.get(), top_, values.get());
+
+      values_ = std::move(values);
+      capacity_ = capacity;
+      top_ = values_.get() + size;
+    }
+
+    size_t size() const noexcept { return static_cast<size_t>(top_ - values_.get()); }
+    size_t capacity() const noexcept { return capacity_; }
+
+    Value& back() noexcept { return top_[-1]; }
+    const Value& back() const noexcept { return top_[-1]; }
+    const Value& fromTop(size_t distance) const noexcept { return top_[-1 - static_cast<std::ptrdiff_t>(distance)]; }
+    Value& operator[](size_t index) noexcept { return values_[index]; }
+
+    void push_back(const Value& value) noexcept { *top_++ = value; }
+    template<typename... Arguments>
+    void emplace_back(Arguments&&... arguments) noexcept { *top_++ = Value { std::forward<Arguments>(arguments)... }; }
+    void pop_back() noexcept { --top_; }
+    void truncate(size_t size) noexcept { top_ = values_.get() + size; }
+    void clear() noexcept { top_ = values_.get(); }
+
+    const Value* begin() const noexcept { return values_.get(); }
+    const Value* end() const noexcept { return top_; }
+
+  private:
+    std::unique_ptr<Value[]> values_ {};
+    size_t capacity_ { 0 };
+    Value* top_ { nullptr };
+  };
+}
@@ -0,0 +1,85 @@
+#include "verifier.h"
+
+#include "chunk.h"
+#include "type-inference.h"
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace Lox {
+  static std::string problemAt(size_t offset, const std::string& description) {
+    return "Offset " + std::to_string(offset) + ": " + description;
+  }
+
+  std::optional<std::string> findVerificationProblem(const Chunk& chunk, size_t entry) {
+    constexpr auto unvisited = std::numeric_limits<size_t>::max();
+
+    std::vector<bool> isInstruction(chunk.size(), false);
+    for (size_t offset = 0; offset < chunk.size();) {
+      if (chunk.read(offset) > static_cast<std::byte>(OpCode::Return)) return problemAt(offset, "invalid opcode.");
+
+      isInstruction[offset] = true;
+      offset += hasOperand(static_cast<OpCode>(chunk.read(offset))) ? 2 : 1;
+      if (offset > chunk.size()) return problemAt(offset - 2, "missing operand.");
+    }
+
+    if (entry >= chunk.size() || !isInstruction[entry]) return problemAt(entry, "entry is not an instruction.");
+
+    for (size_t i = 0; i < chunk.constantCount(); ++i) {
+      const auto function = std::get_if<ObjFunction*>(&chunk.getConstant(i));
+      if (function && !(*function)->chunk->isVerified()) return "Constant " + std::to_string(i) + ": function is not verified.";
+    }
+
+    std::vector<size_t> depths(chunk.size(), unvisited);
+    std::vector<std::pair<size_t, size_t>> worklist { { entry, chunk.arity() } };
+    while (!worklist.empty()) {
+      auto [offset, depth] = worklist.back();
+      worklist.pop_back();
+
+      while (true) {
+        if (offset >= chunk.size()) return problemAt(offset, "execution runs past the end of the chunk.");
+        if (depths[offset] != unvisited) {
+          if (depths[offset] != depth) return problemAt(offset, "stack depth differs between paths.");
+          break;
+        }
+
+        depths[offset] = depth;
+        if (!chunk.hasPosition(offset)) return problemAt(offset, "missing source position.");
+
+        const auto opCode = static_cast<OpCode>(chunk.read(offset));
+        const auto operand = hasOperand(opCode) ? static_cast<size_t>(chunk.read(offset + 1)) : 0;
+        const auto next = offset + (hasOperand(opCode) ? 2 : 1);
+        if (opCode == OpCode::Constant && operand >= chunk.constantCount()) return problemAt(offset, "constant index out of range.");
+        if ((opCode == OpCode::GetLocal || opCode == OpCode::SetLocal) && operand >= depth) {
+          return problemAt(offset, "local slot out of range.");
+        }
+
+        const auto effect = stackEffect(opCode, operand);
+        if (effect.pops > depth) return problemAt(offset, "stack underflow.");
+
+        depth = depth - effect.pops + effect.pushes;
+        if (isReturn(opCode)) break;
+
+        if (isBranch(opCode)) {
+          if (isBackwardBranch(opCode) && operand > next) return problemAt(offset, "loop target before the chunk.");
+
+          const auto target = branchTarget(opCode, next, operand);
+          if (target >= chunk.size() || !isInstruction[target]) return problemAt(offset, "jump target is not an instruction.");
+
+          if (isUnconditionalBranch(opCode)) {
+            offset = target;
+            continue;
+          }
+
+          worklist.emplace_back(target, depth);
+        }
+
+        offset = next;
+      }
+    }
+
+    if (const auto problem = findTypeProblem(chunk, entry)) return problemAt(problem->offset, problem->description);
+
+    return std::nullopt;
+  }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+
+namespace Lox {
+  class Chunk;
+
+  // Checks every path from entry, which must begin with only the chunk's arguments on the stack: opcodes and operands
+  // are in bounds, jumps land on instructions, constant and local indices exist, the stack never underflows and has
+  // one depth at each instruction, execution always reaches a return, global names are strings, and number forms only
+  // see numbers. Function constants must have been verified already. Returns a description of the first problem found,
+  // or nothing for a sound chunk.
+  std::optional<std::string> findVerificationProblem(const Chunk& chunk, size_t entry = 0);
+}
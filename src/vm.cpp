@@ -1,204 +1,622 @@
 #include "vm.h"
 
-#include <iostream>
-#include <sstream>
+#include "binary-io.h"
+#include "verifier.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <functional>
 #include <stdexcept>
+#include <utility>
 
 namespace Lox {
+  static constexpr char snapshotMagic[] = { 'L', 'O', 'X', 'S' };
+  static constexpr std::uint8_t snapshotVersion = 3;
+  static constexpr size_t maxRetainedGlobals = 4096;
+
+  enum class SnapshotTag : std::uint8_t {
+    Nil,
+    Boolean,
+    Number,
+    String,
+    Native,
+    Function
+  };
+
   static constexpr bool isTruthy(const Value& value) {
     return std::holds_alternative<bool>(value) ? std::get<bool>(value) : !std::holds_alternative<std::monostate>(value);
   }
 
-  static std::string stringify(const Value& value) {
-    if (const auto string = std::get_if<std::string>(&value)) return *string;
+  // The number array is large enough for the shortest round-trip form of any double.
+  struct TextBuffer {
+    std::array<char, 32> number;
+    std::string function;
+  };
+
+  // Numbers are formatted like printf's %g unless exact output was requested.
+  static std::string_view stringify(const Value& value, TextBuffer& buffer, bool isExact) {
+    if (const auto string = std::get_if<ObjString*>(&value)) return (*string)->chars;
 
     if (const auto number = std::get_if<double>(&value)) {
-      std::ostringstream oss {};
-      oss << *number;
-      return oss.str();
+      const auto begin = buffer.number.data();
+      const auto end = begin + buffer.number.size();
+      const auto result = isExact
+        ? std::to_chars(begin, end, *number)
+        : std::to_chars(begin, end, *number, std::chars_format::general, 6);
+      return { begin, static_cast<size_t>(result.ptr - begin) };
     }
 
     if (const auto boolean = std::get_if<bool>(&value)) return *boolean ? "true" : "false";
+    if (std::holds_alternative<ObjNative*>(value)) return "<native fn>";
+    if (const auto function = std::get_if<ObjFunction*>(&value)) return buffer.function = "<fn " + (*function)->name + ">";
 
     return "nil";
   }
 
   ResultStatus VM::interpret(std::string_view source, unsigned line) {
+    auto chunk = compile(source, line);
+    return chunk ? run(std::move(chunk)) : ResultStatus::StaticError;
+  }
+
+  std::shared_ptr<const Chunk> VM::compile(std::string_view source, unsigned line) {
     errorReporter_.reset();
 
-    chunk_ = compiler_.compile(source, line);
+    std::shared_ptr<const Chunk> chunk = compiler_.compile(source, line);
     if (errorReporter_.errorCount() > 0) {
       errorReporter_.displayErrorCount();
       compiler_.reset();
-      return ResultStatus::StaticError;
+      return nullptr;
     }
 
 #ifndef NDEBUG
-    chunkPrinter_.print(*chunk_, "root");
+    chunkPrinter_.print(*chunk, "root");
 #endif
+    return chunk;
+  }
+
+  ResultStatus VM::interpretIncrementally(std::string_view source, unsigned line) {
+    if (!session_) session_ = std::make_shared<Chunk>();
+
+    errorReporter_.reset();
+    const auto start = session_->size();
+    const auto constantCount = session_->constantCount();
     try {
-      execute();
-    } catch (const LoxError& error) {
-      errorReporter_.report(error, true);
-      valueStack_.clear();
-      return ResultStatus::DynamicError;
+      compiler_.append(*session_, source, line);
+    } catch (const std::overflow_error&) {
+      compiler_.reset();
+      if (start == 0) throw;
+
+      // The session chunk is full, so continue in a fresh one; globals live in the VM and are unaffected.
+      session_ = std::make_shared<Chunk>();
+      return interpretIncrementally(source, line);
+    }
+
+    if (errorReporter_.errorCount() > 0) {
+      errorReporter_.displayErrorCount();
+      compiler_.reset();
+      session_->truncate(start);
+      session_->truncateConstants(constantCount);
+      return ResultStatus::StaticError;
+    }
+
+#ifndef NDEBUG
+    chunkPrinter_.print(*session_, "session");
+#endif
+    return runFrom(session_, start);
+  }
+
+  // A suspended statement could not be resumed once its segment is reused for the next one, so fuel is set aside.
+  ResultStatus VM::interpretStreaming(std::string_view source, unsigned line) {
+    errorReporter_.reset();
+    compiler_.begin(source, line);
+
+    auto segment = std::make_shared<Chunk>();
+    while (compiler_.compileNext(*segment)) {
+      if (errorReporter_.errorCount() == 0) {
+        const auto fuel = std::exchange(fuel_, std::numeric_limits<size_t>::max());
+        const auto status = run(segment);
+        fuel_ = fuel;
+        if (status == ResultStatus::DynamicError) return ResultStatus::DynamicError;
+      }
+
+      segment->clear();
+    }
+
+    if (errorReporter_.errorCount() > 0) {
+      errorReporter_.displayErrorCount();
+      compiler_.reset();
+      return ResultStatus::StaticError;
     }
 
     return ResultStatus::OK;
   }
 
-  void VM::execute() {
-    for (offset_ = 0; offset_ < chunk_->size(); ++offset_) {
-      const auto opCode = static_cast<OpCode>(chunk_->read(offset_));
+  ResultStatus VM::run(std::shared_ptr<const Chunk> chunk) {
+    return runFrom(std::move(chunk), 0);
+  }
+
+  ResultStatus VM::runFrom(std::shared_ptr<const Chunk> chunk, size_t offset) {
+    chunk_ = std::move(chunk);
+    code_ = chunk_.get();
+    offset_ = offset;
+    base_ = 0;
+    frames_.clear();
+    valueStack_.clear();
+    isSuspended_ = false;
+    return proceed();
+  }
+
+  // After a dynamic error, offset_ still points at the failing instruction, so only a suspended run may continue.
+  ResultStatus VM::resume() {
+    if (!isSuspended_) {
+      errorReporter_.report("Only a suspended run can be resumed.", true);
+      return ResultStatus::DynamicError;
+    }
+
+    return proceed();
+  }
+
+  // Execution has no bounds checks, so only chunks that passed the verifier are run. Every function a verified chunk
+  // can reach has been verified too.
+  ResultStatus VM::proceed() {
+    if (!chunk_->isVerified()) {
+      errorReporter_.report("Only verified chunks can be run.");
+      isSuspended_ = false;
+      return ResultStatus::StaticError;
+    }
+
+    valueStack_.reserve(valueStack_.size() + code_->maxStackDepth());
+
+    const auto start = std::chrono::steady_clock::now();
+    if (profiler_) profiler_->enter(offset_);
+    const auto status = execute();
+    if (profiler_) profiler_->leave(*code_);
+    runMetrics_.runTime += std::chrono::steady_clock::now() - start;
+
+    if (status == ResultStatus::DynamicError) {
+      const auto [line, column] = code_->getPosition(offset_);
+      errorReporter_.report(line, column, describeError(), true);
+      valueStack_.clear();
+      frames_.clear();
+      code_ = chunk_.get();
+      base_ = 0;
+    }
+
+    isSuspended_ = status == ResultStatus::Suspended;
+    return status;
+  }
+
+  Value VM::makeString(std::string_view string) {
+    return allocateString(std::string { string });
+  }
+
+  void VM::setGlobal(std::string_view name, Value value) {
+    globalKey_.assign(name);
+    const auto global = globals_.find(globalKey_);
+    if (global != globals_.end()) {
+      global->second = escape(value);
+    } else {
+      globals_.emplace(std::string { name }, escape(value));
+    }
+  }
+
+  void VM::defineNative(std::string name, size_t arity, NativeFunction function) {
+    auto& native = nativeObjects_.emplace_back(std::string { name }, arity, function);
+    natives_[std::move(name)] = &native;
+  }
+
+  const Value* VM::getGlobal(std::string_view name) const {
+    globalKey_.assign(name);
+    const auto global = globals_.find(globalKey_);
+    return global == globals_.cend() || !global->second ? nullptr : &*global->second;
+  }
+
+  Metrics VM::metrics() const {
+    auto run = runMetrics_;
+    run.stringBytesAllocated = heap_.stats().bytesAllocated - heapBytesAtReset_;
+    for (const auto& global : globals_) run.globalCount += global.second.has_value();
+
+    return { compiler_.metrics(), run };
+  }
+
+  void VM::resetMetrics() {
+    compiler_.resetMetrics();
+    runMetrics_ = {};
+    heapBytesAtReset_ = heap_.stats().bytesAllocated;
+  }
+
+  void VM::reset() {
+    errorReporter_.reset();
+    isSuspended_ = false;
+    valueStack_.clear();
+    frames_.clear();
+    base_ = 0;
+    forgetGlobals();
+    retainedFunctions_.clear();
+  }
+
+  void VM::writeSnapshot(std::ostream& output) const {
+    std::vector<const ObjString*> strings {};
+    std::unordered_map<const ObjString*, std::uint32_t> stringIndices {};
+    for (const auto& global : globals_) {
+      const auto string = global.second ? std::get_if<ObjString*>(&*global.second) : nullptr;
+      if (string && stringIndices.emplace(*string, static_cast<std::uint32_t>(strings.size())).second) strings.push_back(*string);
+    }
+
+    const auto writeString = [&](const std::string& chars) {
+      writeRaw(output, static_cast<std::uint32_t>(chars.size()));
+      output.write(chars.data(), static_cast<std::streamsize>(chars.size()));
+    };
+
+    output.write(snapshotMagic, sizeof(snapshotMagic));
+    writeRaw(output, snapshotVersion);
+
+    writeRaw(output, static_cast<std::uint32_t>(strings.size()));
+    for (const auto string : strings) writeString(string->chars);
+
+    const auto globalCount = std::count_if(globals_.cbegin(), globals_.cend(), [](const auto& global) { return global.second.has_value(); });
+    writeRaw(output, static_cast<std::uint32_t>(globalCount));
+    for (const auto& [name, value] : globals_) {
+      if (!value) continue;
+
+      writeString(name);
+      if (const auto string = std::get_if<ObjString*>(&*value)) {
+        writeRaw(output, SnapshotTag::String);
+        writeRaw(output, stringIndices.find(*string)->second);
+      } else if (const auto number = std::get_if<double>(&*value)) {
+        writeRaw(output, SnapshotTag::Number);
+        writeRaw(output, *number);
+      } else if (const auto boolean = std::get_if<bool>(&*value)) {
+        writeRaw(output, SnapshotTag::Boolean);
+        writeRaw(output, static_cast<std::uint8_t>(*boolean));
+      } else if (const auto native = std::get_if<ObjNative*>(&*value)) {
+        writeRaw(output, SnapshotTag::Native);
+        writeString((*native)->name);
+      } else if (const auto function = std::get_if<ObjFunction*>(&*value)) {
+        writeRaw(output, SnapshotTag::Function);
+        writeString((*function)->name);
+        (*function)->chunk->serialize(output);
+      } else {
+        writeRaw(output, SnapshotTag::Nil);
+      }
+    }
+  }
+
+  // Strings go straight to the heap rather than through allocateString, since a collection
+  // before the globals are restored would free the ones already read.
+  bool VM::readSnapshot(std::istream& input) {
+    const auto readString = [&](std::string& chars) {
+      std::uint32_t length = 0;
+      return readRaw(input, length) && readBytes(input, chars, length);
+    };
+
+    char header[sizeof(snapshotMagic)];
+    std::uint8_t version = 0;
+    if (!input.read(header, sizeof(header)) || !std::equal(header, header + sizeof(header), snapshotMagic)) return false;
+    if (!readRaw(input, version) || version != snapshotVersion) return false;
+
+    std::uint32_t stringCount = 0;
+    if (!readRaw(input, stringCount)) return false;
+
+    std::vector<ObjString*> strings {};
+    for (std::uint32_t i = 0; i < stringCount; ++i) {
+      std::string chars {};
+      if (!readString(chars)) return false;
+
+      strings.push_back(heap_.makeString(std::move(chars)));
+    }
+
+    std::uint32_t globalCount = 0;
+    if (!readRaw(input, globalCount)) return false;
+
+    std::vector<std::pair<std::string, Value>> globals {};
+    std::vector<std::shared_ptr<ObjFunction>> functions {};
+    for (std::uint32_t i = 0; i < globalCount; ++i) {
+      std::string name {};
+      auto tag = SnapshotTag::Nil;
+      if (!readString(name) || !readRaw(input, tag)) return false;
+
+      switch (tag) {
+        case SnapshotTag::Nil:
+          globals.emplace_back(std::move(name), Value {});
+          break;
+        case SnapshotTag::Boolean: {
+          std::uint8_t boolean = 0;
+          if (!readRaw(input, boolean)) return false;
+
+          globals.emplace_back(std::move(name), boolean != 0);
+        } break;
+        case SnapshotTag::Number: {
+          auto number = 0.0;
+          if (!readRaw(input, number)) return false;
+
+          globals.emplace_back(std::move(name), number);
+        } break;
+        case SnapshotTag::String: {
+          std::uint32_t index = 0;
+          if (!readRaw(input, index) || index >= strings.size()) return false;
+
+          globals.emplace_back(std::move(name), strings[index]);
+        } break;
+        case SnapshotTag::Native: {
+          std::string nativeName {};
+          if (!readString(nativeName)) return false;
+
+          const auto native = natives_.find(nativeName);
+          if (native == natives_.cend()) return false;
+
+          globals.emplace_back(std::move(name), native->second);
+        } break;
+        case SnapshotTag::Function: {
+          std::string functionName {};
+          if (!readString(functionName)) return false;
+
+          std::shared_ptr<Chunk> chunk = Chunk::deserialize(input);
+          if (!chunk || findVerificationProblem(*chunk)) return false;
+
+          chunk->setVerified(true);
+          const auto& function = functions.emplace_back(std::make_shared<ObjFunction>(std::move(functionName), std::move(chunk)));
+          globals.emplace_back(std::move(name), function.get());
+        } break;
+        default:
+          return false;
+      }
+    }
+
+    forgetGlobals();
+    retainedFunctions_.clear();
+    for (auto& function : functions) retainedFunctions_.emplace(function.get(), std::move(function));
+    globals_.reserve(globals_.size() + globals.size());
+    for (auto& [name, value] : globals) globals_[std::move(name)] = value;
+    return true;
+  }
+
+  // When suspended at a loop back-edge or a call, offset_ is already at the loop target or the callee's entry;
+  // on a dynamic error, offset_ is left at the failing instruction of code_ and error_ says what went wrong.
+  // Verified chunks always reach a return with valid jumps, indices and stack depths, so nothing here is bounds-checked.
+  ResultStatus VM::execute() {
+    for (;; ++offset_) {
+      runMetrics_.instructionCount++;
+      const auto opCode = static_cast<OpCode>(code_->read(offset_));
 
       switch (opCode) {
         case OpCode::Constant: {
-          const auto index = static_cast<size_t>(chunk_->read(++offset_));
-          valueStack_.push_back(chunk_->getConstant(index));
+          const auto index = static_cast<size_t>(code_->read(++offset_));
+          valueStack_.push_back(code_->getConstant(index));
+          notePush();
         } break;
         case OpCode::Nil:
           valueStack_.emplace_back();
+          notePush();
           break;
         case OpCode::True:
           valueStack_.emplace_back(true);
+          notePush();
           break;
         case OpCode::False:
           valueStack_.emplace_back(false);
+          notePush();
           break;
         case OpCode::Pop:
           valueStack_.pop_back();
           break;
         case OpCode::DefineGlobal: {
           const auto value = pop();
-          const auto name = std::get<std::string>(pop());
-          if (globals_.find(name) != globals_.cend()) {
-            throw LoxError { chunk_->getPosition(offset_), "Identifier '" + name + "' is already defined." };
-          }
-          globals_.emplace(name, value);
+          const auto& name = std::get<ObjString*>(valueStack_.back())->chars;
+          auto& global = globals_[name];
+          if (global) return fail(RuntimeError::AlreadyDefined, name);
+
+          global = escape(value);
+          valueStack_.pop_back();
         } break;
         case OpCode::SetGlobal: {
           const auto newValue = pop();
-          const auto name = std::get<std::string>(valueStack_.back());
+          const auto& name = std::get<ObjString*>(valueStack_.back())->chars;
           const auto oldValue = globals_.find(name);
-          if (oldValue == globals_.cend()) {
-            throw LoxError { chunk_->getPosition(offset_), "Identifier '" + name + "' is undefined." };
-          }
-          valueStack_.back() = oldValue->second = newValue;
+          if (oldValue == globals_.cend() || !oldValue->second) return fail(RuntimeError::Undefined, name);
+
+          valueStack_.back() = *oldValue->second = escape(newValue);
         } break;
         case OpCode::GetGlobal: {
-          const auto name = std::get<std::string>(valueStack_.back());
+          const auto& name = std::get<ObjString*>(valueStack_.back())->chars;
           const auto value = globals_.find(name);
-          if (value == globals_.cend()) {
-            throw LoxError { chunk_->getPosition(offset_), "Identifier '" + name + "' is undefined." };
+          if (value != globals_.cend() && value->second) {
+            valueStack_.back() = *value->second;
+            break;
           }
-          valueStack_.back() = value->second;
+
+          const auto native = natives_.find(name);
+          if (native == natives_.cend()) return fail(RuntimeError::Undefined, name);
+
+          valueStack_.back() = native->second;
         } break;
         case OpCode::SetLocal: {
-          const auto index = static_cast<size_t>(chunk_->read(++offset_));
-          valueStack_.begin()[index] = valueStack_.back();
+          const auto index = static_cast<size_t>(code_->read(++offset_));
+          valueStack_[base_ + index] = valueStack_.back();
         } break;
         case OpCode::GetLocal: {
-          const auto index = static_cast<size_t>(chunk_->read(++offset_));
-          valueStack_.push_back(valueStack_.cbegin()[index]);
+          const auto index = static_cast<size_t>(code_->read(++offset_));
+          valueStack_.push_back(valueStack_[base_ + index]);
+          notePush();
         } break;
         case OpCode::Equal: {
           const auto rightOperand = pop();
-          valueStack_.back() = valueStack_.back() == rightOperand;
+          valueStack_.back() = valuesEqual(valueStack_.back(), rightOperand);
         } break;
         case OpCode::NotEqual: {
           const auto rightOperand = pop();
-          valueStack_.back() = valueStack_.back() != rightOperand;
-        } break;
-        case OpCode::Greater: {
-          if (peekSecondIs<double>()) {
-            const auto rightOperand = popNumberOperand();
-            valueStack_.back() = std::get<double>(valueStack_.back()) > rightOperand;
-          } else {
-            const auto rightOperand = popStringOperand();
-            valueStack_.back() = peekStringOperand().compare(rightOperand) > 0;
-          }
-        } break;
-        case OpCode::GreaterEqual: {
-          if (peekSecondIs<double>()) {
-            const auto rightOperand = popNumberOperand();
-            valueStack_.back() = std::get<double>(valueStack_.back()) >= rightOperand;
-          } else {
-            const auto rightOperand = popStringOperand();
-            valueStack_.back() = peekStringOperand().compare(rightOperand) >= 0;
-          }
-        } break;
-        case OpCode::Less: {
-          if (peekSecondIs<double>()) {
-            const auto rightOperand = popNumberOperand();
-            valueStack_.back() = std::get<double>(valueStack_.back()) < rightOperand;
-          } else {
-            const auto rightOperand = popStringOperand();
-            valueStack_.back() = peekStringOperand().compare(rightOperand) < 0;
-          }
-        } break;
-        case OpCode::LessEqual: {
-          if (peekSecondIs<double>()) {
-            const auto rightOperand = popNumberOperand();
-            valueStack_.back() = std::get<double>(valueStack_.back()) <= rightOperand;
-          } else {
-            const auto rightOperand = popStringOperand();
-            valueStack_.back() = peekStringOperand().compare(rightOperand) <= 0;
-          }
+          valueStack_.back() = !valuesEqual(valueStack_.back(), rightOperand);
         } break;
+        case OpCode::Greater:
+          if (const auto error = compare(std::greater<> {}); error != RuntimeError::None) return fail(error);
+          break;
+        case OpCode::GreaterEqual:
+          if (const auto error = compare(std::greater_equal<> {}); error != RuntimeError::None) return fail(error);
+          break;
+        case OpCode::Less:
+          if (const auto error = compare(std::less<> {}); error != RuntimeError::None) return fail(error);
+          break;
+        case OpCode::LessEqual:
+          if (const auto error = compare(std::less_equal<> {}); error != RuntimeError::None) return fail(error);
+          break;
         case OpCode::Add: {
-          if (peekIs<std::string>() || peekSecondIs<std::string>()) {
-            const auto rightOperand = pop();
-            valueStack_.back() = stringify(valueStack_.back()) + stringify(rightOperand);
-          } else {
-            const auto rightOperand = popNumberOperand();
-            valueStack_.back() = peekNumberOperand() + rightOperand;
+          if (peekIs<ObjString*>() || peekSecondIs<ObjString*>()) {
+            TextBuffer leftBuffer;
+            TextBuffer rightBuffer;
+            const auto leftOperand = stringify(valueStack_.fromTop(1), leftBuffer, isExactNumberOutput_);
+            const auto rightOperand = stringify(valueStack_.back(), rightBuffer, isExactNumberOutput_);
+
+            std::string chars {};
+            chars.reserve(leftOperand.size() + rightOperand.size());
+            chars.append(leftOperand).append(rightOperand);
+            valueStack_.pop_back();
+            valueStack_.back() = allocateString(std::move(chars));
+          } else if (const auto error = calculate(std::plus<> {}); error != RuntimeError::None) {
+            return fail(error);
           }
         } break;
-        case OpCode::Subtract: {
-          const auto rightOperand = popNumberOperand();
-          valueStack_.back() = peekNumberOperand() - rightOperand;
-        } break;
-        case OpCode::Multiply: {
-          const auto rightOperand = popNumberOperand();
-          valueStack_.back() = peekNumberOperand() * rightOperand;
-        } break;
-        case OpCode::Divide: {
-          const auto rightOperand = popNumberOperand();
-          if (rightOperand == 0) throw LoxError { chunk_->getPosition(offset_), "Cannot divide by zero." };
+        case OpCode::Subtract:
+          if (const auto error = calculate(std::minus<> {}); error != RuntimeError::None) return fail(error);
+          break;
+        case OpCode::Multiply:
+          if (const auto error = calculate(std::multiplies<> {}); error != RuntimeError::None) return fail(error);
+          break;
+        case OpCode::Divide:
+          if (peekIs<double>() && std::get<double>(valueStack_.back()) == 0) return fail(RuntimeError::DivideByZero);
+          if (const auto error = calculate(std::divides<> {}); error != RuntimeError::None) return fail(error);
+          break;
+        case OpCode::Negative: {
+          const auto operand = std::get_if<double>(&valueStack_.back());
+          if (!operand) return fail(RuntimeError::NumberOperand);
 
-          valueStack_.back() = peekNumberOperand() / rightOperand;
+          *operand = -*operand;
         } break;
-        case OpCode::Negative:
-          valueStack_.back() = -peekNumberOperand();
-          break;
         case OpCode::Not:
           valueStack_.back() = !isTruthy(valueStack_.back());
           break;
-        case OpCode::Print:
-          std::cout << stringify(pop()) << '\n';
-          break;
+        // The compiler emits these only where both operands are proven numbers.
+        case OpCode::AddNumber: {
+          const auto rightOperand = std::get<double>(valueStack_.back());
+          valueStack_.pop_back();
+          std::get<double>(valueStack_.back()) += rightOperand;
+        } break;
+        case OpCode::LessNumber: {
+          const auto rightOperand = std::get<double>(valueStack_.back());
+          valueStack_.pop_back();
+          valueStack_.back() = std::get<double>(valueStack_.back()) < rightOperand;
+        } break;
+        case OpCode::NegateNumber: {
+          auto& operand = std::get<double>(valueStack_.back());
+          operand = -operand;
+        } break;
+        case OpCode::Print: {
+          TextBuffer buffer;
+          output_ << stringify(valueStack_.back(), buffer, isExactNumberOutput_) << '\n';
+          valueStack_.pop_back();
+        } break;
         case OpCode::Jump: {
-          const auto distance = static_cast<size_t>(chunk_->read(++offset_));
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
           offset_ += distance;
         } break;
         case OpCode::JumpIfTrue: {
-          const auto distance = static_cast<size_t>(chunk_->read(++offset_));
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
           if (isTruthy(valueStack_.back())) offset_ += distance;
         } break;
         case OpCode::JumpIfFalse: {
-          const auto distance = static_cast<size_t>(chunk_->read(++offset_));
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
+          if (!isTruthy(valueStack_.back())) offset_ += distance;
+        } break;
+        case OpCode::PopJumpIfTrue: {
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
+          if (isTruthy(valueStack_.back())) offset_ += distance;
+          valueStack_.pop_back();
+        } break;
+        case OpCode::PopJumpIfFalse: {
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
           if (!isTruthy(valueStack_.back())) offset_ += distance;
+          valueStack_.pop_back();
         } break;
         case OpCode::Loop: {
-          const auto distance = static_cast<size_t>(chunk_->read(++offset_));
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
+          offset_ -= distance;
+          if (spendFuel()) {
+            ++offset_;
+            return ResultStatus::Suspended;
+          }
+        } break;
+        case OpCode::PopLoopIfTrue: {
+          const auto distance = static_cast<size_t>(code_->read(++offset_));
+          const auto isTaken = isTruthy(valueStack_.back());
+          valueStack_.pop_back();
+          if (!isTaken) break;
+
           offset_ -= distance;
+          if (spendFuel()) {
+            ++offset_;
+            return ResultStatus::Suspended;
+          }
+        } break;
+        // The arguments stay where they are and the result replaces the callee. A function's frame starts at its
+        // first argument, so the arguments become its first locals without being copied.
+        case OpCode::Call: {
+          const auto argumentCount = static_cast<size_t>(code_->read(offset_ + 1));
+          const auto base = valueStack_.size() - argumentCount;
+          if (const auto function = std::get_if<ObjFunction*>(&valueStack_[base - 1])) {
+            const auto& chunk = *(*function)->chunk;
+            if (chunk.arity() != argumentCount) return fail(RuntimeError::ArgumentCount);
+            if (frames_.size() == maxCallDepth_) return fail(RuntimeError::StackOverflow);
+
+            // Growth is geometric, so deep recursion copies the stack only a logarithmic number of times.
+            const auto capacity = base + chunk.maxStackDepth();
+            if (capacity > valueStack_.capacity()) valueStack_.reserve(std::max(capacity, 2 * valueStack_.capacity()));
+
+            if (profiler_) profiler_->leave(*code_);
+            frames_.push_back({ code_, offset_ + 1, base_ });
+            code_ = &chunk;
+            base_ = base;
+            offset_ = 0;
+            if (profiler_) profiler_->enter(offset_);
+            // Calls spend fuel like back-edges, so recursion cannot run unbounded either.
+            if (spendFuel()) return ResultStatus::Suspended;
+
+            // Wraps around, so the loop's increment lands on the function's first instruction.
+            offset_ = std::numeric_limits<size_t>::max();
+            break;
+          }
+
+          auto& callee = valueStack_[base - 1];
+          const auto native = std::get_if<ObjNative*>(&callee);
+          if (!native) return fail(RuntimeError::NotCallable);
+          if ((*native)->arity != argumentCount) return fail(RuntimeError::ArgumentCount);
+
+          try {
+            callee = (*native)->function(*this, &callee + 1);
+          } catch (const NativeError& error) {
+            return fail(RuntimeError::NativeFailed, error.what());
+          }
+
+          valueStack_.truncate(valueStack_.size() - argumentCount);
+          ++offset_;
+        } break;
+        case OpCode::ReturnValue: {
+          if (frames_.empty()) return ResultStatus::OK;
+
+          valueStack_[base_ - 1] = valueStack_.back();
+          valueStack_.truncate(base_);
+
+          const auto& frame = frames_.back();
+          if (profiler_) profiler_->leave(*code_);
+          code_ = frame.chunk;
+          offset_ = frame.offset;
+          base_ = frame.base;
+          frames_.pop_back();
+          if (profiler_) profiler_->enter(offset_);
         } break;
         case OpCode::Return:
-          return;
+          return ResultStatus::OK;
       }
     }
-
-    throw std::logic_error { "Chunk ended without a return!" };
   }
 
   template<typename T>
@@ -208,7 +626,7 @@ namespace Lox {
 
   template<typename T>
   bool VM::peekSecondIs() const {
-    return std::holds_alternative<T>(valueStack_.crbegin()[1]);
+    return std::holds_alternative<T>(valueStack_.fromTop(1));
   }
 
   Value VM::pop() {
@@ -217,10 +635,116 @@ namespace Lox {
     return value;
   }
 
-  template<typename T>
-  T VM::expect(std::string&& errorMessage, bool shouldPop) {
-    if (!peekIs<T>()) throw LoxError { chunk_->getPosition(offset_), std::move(errorMessage) };
+  ObjString* VM::allocateString(std::string&& chars) {
+    if (heap_.shouldCollect()) collectGarbage();
 
-    return std::get<T>(shouldPop ? pop() : valueStack_.back());
+    return heap_.makeString(std::move(chars));
+  }
+
+  // Globals outlive the chunk that assigned them, so a constant string is copied onto the heap before it is stored
+  // and a function is kept alive by the VM.
+  Value VM::escape(const Value& value) {
+    if (const auto function = std::get_if<ObjFunction*>(&value)) {
+      const auto [retained, isNew] = retainedFunctions_.try_emplace(*function);
+      if (isNew) retained->second = (*function)->shared_from_this();
+      return value;
+    }
+
+    const auto string = std::get_if<ObjString*>(&value);
+    if (!string || !(*string)->isConstant) return value;
+
+    return allocateString(std::string { (*string)->chars });
+  }
+
+  // Names are kept as undefined entries so a VM running the same script again finds its globals already allocated,
+  // but only up to a bound, since a VM running many different scripts would otherwise keep every name it has seen.
+  void VM::forgetGlobals() {
+    if (globals_.size() > maxRetainedGlobals) {
+      globals_ = decltype(globals_) {};
+      return;
+    }
+
+    for (auto& global : globals_) global.second.reset();
+  }
+
+  void VM::collectGarbage() {
+    heap_.collect([this] {
+      for (const auto& value : valueStack_) heap_.mark(value);
+      for (const auto& global : globals_) {
+        if (global.second) heap_.mark(*global.second);
+      }
+    });
+  }
+
+  ResultStatus VM::fail(RuntimeError error, std::string_view detail) {
+    error_ = error;
+    errorDetail_ = detail;
+    return ResultStatus::DynamicError;
+  }
+
+  std::string VM::describeError() const {
+    switch (error_) {
+      case RuntimeError::NumberOperand:
+        return "Operand must be a number.";
+      case RuntimeError::StringOperand:
+        return "Operand must be a string.";
+      case RuntimeError::DivideByZero:
+        return "Cannot divide by zero.";
+      case RuntimeError::AlreadyDefined:
+        return "Identifier '" + errorDetail_ + "' is already defined.";
+      case RuntimeError::Undefined:
+        return "Identifier '" + errorDetail_ + "' is undefined.";
+      case RuntimeError::NotCallable:
+        return "Only functions can be called.";
+      case RuntimeError::ArgumentCount: {
+        const auto argumentCount = static_cast<size_t>(code_->read(offset_ + 1));
+        const auto& callee = valueStack_.fromTop(argumentCount);
+        const auto native = std::get_if<ObjNative*>(&callee);
+        const auto function = std::get_if<ObjFunction*>(&callee);
+        const auto& name = native ? (*native)->name : (*function)->name;
+        const auto arity = native ? (*native)->arity : (*function)->chunk->arity();
+        return
+          "'" + name + "' expects " + std::to_string(arity) + " argument" + (arity == 1 ? "" : "s") +
+          " but got " + std::to_string(argumentCount) + ".";
+      }
+      case RuntimeError::StackOverflow:
+        return "Stack overflow.";
+      case RuntimeError::NativeFailed:
+        return errorDetail_;
+      case RuntimeError::None:
+        break;
+    }
+
+    return {};
+  }
+
+  template<typename Operation>
+  VM::RuntimeError VM::calculate(Operation operation) {
+    if (!peekIs<double>() || !peekSecondIs<double>()) return RuntimeError::NumberOperand;
+
+    const auto rightOperand = std::get<double>(valueStack_.back());
+    valueStack_.pop_back();
+    auto& leftOperand = std::get<double>(valueStack_.back());
+    leftOperand = operation(leftOperand, rightOperand);
+    return RuntimeError::None;
+  }
+
+  template<typename Comparison>
+  VM::RuntimeError VM::compare(Comparison comparison) {
+    auto result = false;
+    if (peekSecondIs<double>()) {
+      if (!peekIs<double>()) return RuntimeError::NumberOperand;
+
+      result = comparison(std::get<double>(valueStack_.fromTop(1)), std::get<double>(valueStack_.back()));
+    } else {
+      if (!peekIs<ObjString*>() || !peekSecondIs<ObjString*>()) return RuntimeError::StringOperand;
+
+      const auto& leftOperand = std::get<ObjString*>(valueStack_.fromTop(1))->chars;
+      result = comparison(leftOperand.compare(std::get<ObjString*>(valueStack_.back())->chars), 0);
+    }
+
+    valueStack_.pop_back();
+    valueStack_.back() = result;
+    return RuntimeError::None;
   }
 }
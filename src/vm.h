@@ -6,7 +6,17 @@
 #include "debug.h"
 #endif
 #include "error-reporter.h"
+#include "heap.h"
+#include "metrics.h"
+#include "natives.h"
+#include "profiler.h"
+#include "value-stack.h"
+#include <deque>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -16,35 +26,164 @@ namespace Lox {
   enum class ResultStatus {
     OK,
     StaticError,
-    DynamicError
+    DynamicError,
+    Suspended
+  };
+
+  // Thrown by a native to fail its call with a runtime error carrying the message.
+  struct NativeError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  struct VMOptions {
+    bool shouldOptimize { false };
+    size_t stackCapacity { 0 };
+    size_t maxCallDepth { 1024 };
+    size_t initialHeapSize { 1024 * 1024 };
+    double heapGrowthFactor { 2.0 };
+    bool isExactNumberOutput { false };
+    Profiler* profiler { nullptr };
   };
 
   class VM {
   public:
+    explicit VM(const VMOptions& options = {}, std::ostream& output = std::cout, std::ostream& errorOutput = std::cerr)
+      : output_(output), errorReporter_(errorOutput), compiler_(errorReporter_, options.shouldOptimize),
+        heap_(options.initialHeapSize, options.heapGrowthFactor), maxCallDepth_(options.maxCallDepth),
+        isExactNumberOutput_(options.isExactNumberOutput), profiler_(options.profiler) {
+      valueStack_.reserve(options.stackCapacity);
+      frames_.reserve(maxCallDepth_);
+      defineStandardNatives(*this);
+    }
+
     ResultStatus interpret(std::string_view source, unsigned line);
 
+    // Appends to a persistent session chunk and executes only the new code, so repeated global names keep
+    // their constant slots and nothing already compiled is recompiled.
+    ResultStatus interpretIncrementally(std::string_view source, unsigned line);
+
+    // Runs each top-level statement as soon as it is compiled, reusing one chunk's storage throughout.
+    // Statements before a static error have already run by the time it is reported. Streaming never suspends:
+    // it runs without a fuel limit and leaves the budget as it was.
+    ResultStatus interpretStreaming(std::string_view source, unsigned line);
+
+    // A compiled chunk is immutable and may be run by any number of VMs at once, including on other threads.
+    // run and resume refuse a chunk that has not been marked verified, returning StaticError.
+    std::shared_ptr<const Chunk> compile(std::string_view source, unsigned line);
+    ResultStatus run(std::shared_ptr<const Chunk> chunk);
+
+    // Fuel is spent on each loop back-edge and function call; when it runs out, run and resume return Suspended
+    // and a later resume picks up where execution stopped. An empty budget, including one left empty by a
+    // suspension, suspends again at the next back-edge or call. run always starts afresh, abandoning a suspended run;
+    // resume fails with DynamicError unless the VM is suspended.
+    void setFuel(size_t fuel) noexcept { fuel_ = fuel; }
+    void clearFuel() noexcept { fuel_ = std::numeric_limits<size_t>::max(); }
+    constexpr bool isSuspended() const noexcept { return isSuspended_; }
+    ResultStatus resume();
+
+    // Strings live on the VM's garbage-collected heap and stay valid while a global or the stack refers to them.
+    // A function stored in a global is kept alive by the VM until the next reset.
+    Value makeString(std::string_view string);
+    void setGlobal(std::string_view name, Value value);
+    const Value* getGlobal(std::string_view name) const;
+
+    // A native is visible to scripts under its name wherever no global of that name is defined, and survives reset
+    // and readSnapshot. Defining a name again replaces the native for later lookups.
+    void defineNative(std::string name, size_t arity, NativeFunction function);
+
+    // Forgets all globals and stack contents while keeping their storage for the next run, unless so many names
+    // have been defined that keeping them all would only grow the VM.
+    void reset();
+
+    // A snapshot holds every defined global, with strings shared between globals stored once. Reading one
+    // replaces all globals, so a prelude can be run once and later VMs can start from its result.
+    // A global holding a native is stored by the native's name and one holding a function by its own copy of the
+    // function's bytecode. readSnapshot returns false and leaves the globals untouched if the input is truncated,
+    // from another version, names a native this VM does not define or holds bytecode that fails verification.
+    void writeSnapshot(std::ostream& output) const;
+    bool readSnapshot(std::istream& input);
+
+    constexpr const HeapStats& heapStats() const noexcept { return heap_.stats(); }
+
+    // Compile and run metrics accumulated since construction or the last resetMetrics.
+    Metrics metrics() const;
+    void resetMetrics();
+
   private:
-    void execute();
+    // Failing instructions only record what went wrong; the message is built once, when it is reported.
+    enum class RuntimeError {
+      None,
+      NumberOperand,
+      StringOperand,
+      DivideByZero,
+      AlreadyDefined,
+      Undefined,
+      NotCallable,
+      ArgumentCount,
+      StackOverflow,
+      NativeFailed
+    };
+
+    // Where a function call returns to; the callee's arguments and locals start at base.
+    struct CallFrame {
+      const Chunk* chunk;
+      size_t offset;
+      size_t base;
+    };
+
+    ResultStatus runFrom(std::shared_ptr<const Chunk> chunk, size_t offset);
+    ResultStatus proceed();
+    ResultStatus execute();
+    ResultStatus fail(RuntimeError error, std::string_view detail = {});
+    std::string describeError() const;
 
     template<typename T> bool peekIs() const;
     template<typename T> bool peekSecondIs() const;
     Value pop();
+    // Returns whether the budget has run out.
+    bool spendFuel() noexcept { return fuel_ == 0 || --fuel_ == 0; }
+    void notePush() noexcept {
+      if (valueStack_.size() > runMetrics_.peakStackDepth) runMetrics_.peakStackDepth = valueStack_.size();
+    }
+
+    ObjString* allocateString(std::string&& chars);
+    Value escape(const Value& value);
+    void forgetGlobals();
+    void collectGarbage();
 
-    template<typename T> T expect(std::string&& errorMessage, bool shouldPop);
-    double peekNumberOperand() { return expect<double>("Operand must be a number.", false); }
-    double popNumberOperand() { return expect<double>("Operand must be a number.", true); }
-    std::string peekStringOperand() { return expect<std::string>("Operand must be a string.", false); }
-    std::string popStringOperand() { return expect<std::string>("Operand must be a string.", true); }
+    template<typename Operation> RuntimeError calculate(Operation operation);
+    template<typename Comparison> RuntimeError compare(Comparison comparison);
 
-    ErrorReporter errorReporter_ {};
-    Compiler compiler_ { errorReporter_ };
-    std::vector<Value> valueStack_ {};
-    std::unordered_map<std::string, Value> globals_ {};
+    std::ostream& output_;
+    ErrorReporter errorReporter_;
+    Compiler compiler_;
+    Heap heap_;
+    ValueStack valueStack_ {};
+    std::unordered_map<std::string, std::optional<Value>> globals_ {};
+    // Reused to look up globals by view from C++ without allocating a key each time.
+    mutable std::string globalKey_ {};
+    std::deque<ObjNative> nativeObjects_ {};
+    std::unordered_map<std::string, ObjNative*> natives_ {};
+    std::unordered_map<const ObjFunction*, std::shared_ptr<ObjFunction>> retainedFunctions_ {};
 #ifndef NDEBUG
-    ChunkPrinter chunkPrinter_ {};
+    ChunkPrinter chunkPrinter_ { output_ };
 #endif
 
-    std::unique_ptr<Chunk> chunk_;
+    std::shared_ptr<Chunk> session_;
+    // chunk_ is the running program; code_ is the chunk being executed, which is a function's during a call.
+    std::shared_ptr<const Chunk> chunk_;
+    const Chunk* code_ { nullptr };
     size_t offset_ { 0 };
+    size_t base_ { 0 };
+    std::vector<CallFrame> frames_ {};
+    const size_t maxCallDepth_;
+    RuntimeError error_ { RuntimeError::None };
+    std::string errorDetail_ {};
+    size_t fuel_ { std::numeric_limits<size_t>::max() };
+    const bool isExactNumberOutput_;
+    Profiler* const profiler_;
+    RunMetrics runMetrics_ {};
+    size_t heapBytesAtReset_ { 0 };
+    bool isSuspended_ { false };
   };
 }